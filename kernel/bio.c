@@ -4,6 +4,10 @@
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
+// Buffers come from a slab cache. The cache keeps one buffer
+// for every BUFPAGES pages free at boot, and at least NBUF,
+// and grows past that while they are all in use. A hash table
+// of the cached blocks makes finding one quick.
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
@@ -22,10 +26,17 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "slab.h"
+
+#define BUFPAGES 32   // free pages at boot per buffer kept
+#define NBHASH   251  // hash table buckets
 
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  int n;                   // buffers in the list
+  int keep;                // buffers to keep
+  struct slabcache cache;
+  struct buf *hash[NBHASH];  // through hnext, by block
 
   // Linked list of all buffers, through prev/next.
   // Sorted by how recently the buffer was used.
@@ -36,56 +47,124 @@ struct {
 void
 binit(void)
 {
-  struct buf *b;
-
   initlock(&bcache.lock, "bcache");
+  slabinit(&bcache.cache, "buf", sizeof(struct buf));
 
-  // Create linked list of buffers
+  // Create an empty list of buffers
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+
+  bcache.keep = kfreepages() / BUFPAGES;
+  if(bcache.keep < NBUF)
+    bcache.keep = NBUF;
+}
+
+static struct buf**
+bucket(uint dev, uint blockno)
+{
+  return &bcache.hash[(dev * 31 + blockno) % NBHASH];
+}
+
+// Take b out of the hash table, if it's there.
+// Caller holds bcache.lock.
+static void
+unhash(struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = bucket(b->dev, b->blockno); *pp; pp = &(*pp)->hnext){
+    if(*pp == b){
+      *pp = b->hnext;
+      return;
+    }
   }
 }
 
+// Add buffer b, fresh from the slab cache, to the list.
+// Caller holds bcache.lock.
+static struct buf*
+addbuf(struct buf *b)
+{
+  initsleeplock(&b->lock, "buffer");
+  b->dev = -1;
+  b->hnext = 0;
+  b->next = bcache.head.next;
+  b->prev = &bcache.head;
+  bcache.head.next->prev = b;
+  bcache.head.next = b;
+  bcache.n++;
+  return b;
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct buf *b, *nb;
+  int recycle;
 
+  nb = 0;
+  recycle = 0;
   acquire(&bcache.lock);
+  for(;;){
+    // Is the block already cached?
+    for(b = *bucket(dev, blockno); b; b = b->hnext){
+      if(b->dev == dev && b->blockno == blockno){
+        b->refcnt++;
+        release(&bcache.lock);
+        if(nb)
+          slabfree(&bcache.cache, nb);
+        acquiresleep(&b->lock);
+        return b;
+      }
+    }
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+    // Not cached.
+    // Recycle the least recently used (LRU) unused buffer,
+    // once there are bcache.keep, or if memory for another
+    // ran out; otherwise, or if all are in use, add one.
+    b = &bcache.head;
+    if(bcache.n >= bcache.keep || recycle){
+      for(b = bcache.head.prev; b != &bcache.head; b = b->prev)
+        if(b->refcnt == 0)
+          break;
+    }
+    if(b != &bcache.head)
+      break;
+    if(nb){
+      b = addbuf(nb);
+      nb = 0;
+      break;
     }
-  }
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+    // allocate without the lock, so that kalloc() can swap
+    // or kill for memory, then look again, since another
+    // process may have added the block meanwhile. with no
+    // memory at all, wait for a buffer to be released.
+    release(&bcache.lock);
+    nb = slaballoc(&bcache.cache);
+    acquire(&bcache.lock);
+    if(nb == 0){
+      if(recycle)
+        sleep(&bcache, &bcache.lock);
+      recycle = 1;
     }
   }
-  panic("bget: no buffers");
+
+  unhash(b);
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->hnext = *bucket(dev, blockno);
+  *bucket(dev, blockno) = b;
+  release(&bcache.lock);
+  if(nb)
+    slabfree(&bcache.cache, nb);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -111,8 +190,24 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Write n locked buffers to disk, all at once, so that the
+// disk queue can sort them and merge neighbours into single
+// requests. Their writes may reach the disk in any order.
+void
+bwriten(struct buf **bs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwriten");
+  }
+  virtio_disk_writebufs(bs, n);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Move to the head of the most-recently-used list,
+// or free it if the cache has grown past bcache.keep.
 void
 brelse(struct buf *b)
 {
@@ -125,8 +220,16 @@ brelse(struct buf *b)
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
+    wakeup(&bcache);  // bget() may be, for a buffer to recycle
     b->next->prev = b->prev;
     b->prev->next = b->next;
+    if(bcache.n > bcache.keep){
+      unhash(b);
+      bcache.n--;
+      release(&bcache.lock);
+      slabfree(&bcache.cache, b);
+      return;
+    }
     b->next = bcache.head.next;
     b->prev = &bcache.head;
     bcache.head.next->prev = b;
@@ -136,6 +239,28 @@ brelse(struct buf *b)
   release(&bcache.lock);
 }
 
+// Free the buffers no one is using, when memory is short.
+// They are clean: the log keeps the ones it has yet to
+// write pinned.
+void
+bshrink(void)
+{
+  struct buf *b, *prev;
+
+  acquire(&bcache.lock);
+  for(b = bcache.head.prev; b != &bcache.head; b = prev){
+    prev = b->prev;
+    if(b->refcnt == 0){
+      b->next->prev = b->prev;
+      b->prev->next = b->next;
+      unhash(b);
+      bcache.n--;
+      slabfree(&bcache.cache, b);
+    }
+  }
+  release(&bcache.lock);
+}
+
 void
 bpin(struct buf *b) {
   acquire(&bcache.lock);
@@ -7,6 +7,11 @@ struct buf {
   uint refcnt;
   struct buf *prev; // LRU cache list
   struct buf *next;
+  struct buf *hnext; // hash chain
+  struct buf *qnext; // disk queue
+  int qwrite;        // queued to be written, not read
+  int qpid;          // for whom
+  uint qtime;        // and since when
   uchar data[BSIZE];
 };
 
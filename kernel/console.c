@@ -27,8 +27,8 @@
 
 //
 // send one character to the uart.
-// called by printf(), and to echo input characters,
-// but not from write().
+// called to echo input characters,
+// but not from write() or printf().
 //
 void
 consputc(int c)
@@ -50,21 +50,27 @@ struct {
   uint r;  // Read index
   uint w;  // Write index
   uint e;  // Edit index
+  int throttled;  // uart receive interrupts are off because buf is full
 } cons;
 
 //
 // user write()s to the console go here.
+// copy the data in chunks, so that each chunk costs
+// one copyin() and one trip through uart_tx_lock.
 //
 int
 consolewrite(int user_src, uint64 src, int n)
 {
-  int i;
-
-  for(i = 0; i < n; i++){
-    char c;
-    if(either_copyin(&c, user_src, src+i, 1) == -1)
+  char buf[128];
+  int i, m;
+
+  for(i = 0; i < n; i += m){
+    m = n - i;
+    if(m > sizeof(buf))
+      m = sizeof(buf);
+    if(either_copyin(buf, user_src, src+i, m) == -1)
       break;
-    uartputc(c);
+    uartwrite(buf, m);
   }
 
   return i;
@@ -72,16 +78,16 @@ consolewrite(int user_src, uint64 src, int n)
 
 //
 // user read()s from the console go here.
-// copy (up to) a whole input line to dst.
+// copy (up to) a whole input line to dst,
+// a contiguous run of cons.buf at a time.
 // user_dist indicates whether dst is a user
 // or kernel address.
 //
 int
 consoleread(int user_dst, uint64 dst, int n)
 {
-  uint target;
-  int c;
-  char cbuf;
+  uint target, i;
+  int c, m;
 
   target = n;
   acquire(&cons.lock);
@@ -96,24 +102,44 @@ consoleread(int user_dst, uint64 dst, int n)
       sleep(&cons.r, &cons.lock);
     }
 
-    c = cons.buf[cons.r++ % INPUT_BUF_SIZE];
-
-    if(c == C('D')){  // end-of-file
-      if(n < target){
-        // Save ^D for next time, to make sure
-        // caller gets a 0-byte result.
-        cons.r--;
+    if(cons.buf[cons.r % INPUT_BUF_SIZE] == C('D')){  // end-of-file
+      if(n == target){
+        // consume the ^D, so that the caller
+        // gets a 0-byte result.
+        cons.r++;
       }
+      // otherwise save ^D for next time.
       break;
     }
 
-    // copy the input byte to the user-space buffer.
-    cbuf = c;
-    if(either_copyout(user_dst, dst, &cbuf, 1) == -1)
-      break;
+    // find the run of input bytes that ends at a newline,
+    // a ^D, the end of the input, or the end of cons.buf.
+    c = 0;
+    m = 0;
+    for(i = cons.r; i != cons.w && m < n; ){
+      c = cons.buf[i % INPUT_BUF_SIZE];
+      if(c == C('D'))
+        break;
+      m++;
+      i++;
+      if(c == '\n' || i % INPUT_BUF_SIZE == 0)
+        break;
+    }
 
-    dst++;
-    --n;
+    // copy the run to the user-space buffer.
+    if(either_copyout(user_dst, dst, &cons.buf[cons.r % INPUT_BUF_SIZE], m) == -1){
+      // dst may be out on swap, or shared by ksm.c; fix
+      // that without the lock held, and look at the input again.
+      release(&cons.lock);
+      m = user_dst ? uvmfault(dst, m, 1) : 0;
+      acquire(&cons.lock);
+      if(m <= 0)
+        break;
+      continue;
+    }
+    cons.r += m;
+    dst += m;
+    n -= m;
 
     if(c == '\n'){
       // a whole line has arrived, return to
@@ -121,6 +147,12 @@ consoleread(int user_dst, uint64 dst, int n)
       break;
     }
   }
+
+  if(cons.throttled && cons.e-cons.r < INPUT_BUF_SIZE){
+    // there's room in cons.buf again.
+    cons.throttled = 0;
+    uartrxenable(1);
+  }
   release(&cons.lock);
 
   return target - n;
@@ -131,10 +163,15 @@ consoleread(int user_dst, uint64 dst, int n)
 // uartintr() calls this for input character.
 // do erase/kill processing, append to cons.buf,
 // wake up consoleread() if a whole line has arrived.
+// returns 0 if cons.buf is full, in which case uartintr()
+// should leave further input in the UART until
+// consoleread() makes room.
 //
-void
+int
 consoleintr(int c)
 {
+  int room;
+
   acquire(&cons.lock);
 
   switch(c){
@@ -174,8 +211,17 @@ consoleintr(int c)
     }
     break;
   }
-  
+
+  room = cons.e-cons.r < INPUT_BUF_SIZE;
+  if(!room && !cons.throttled){
+    // stop receive interrupts, since the input
+    // would have nowhere to go.
+    cons.throttled = 1;
+    uartrxenable(0);
+  }
   release(&cons.lock);
+
+  return room;
 }
 
 void
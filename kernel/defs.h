@@ -6,24 +6,29 @@ struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
+struct slabcache;
 struct stat;
 struct superblock;
 
 // bio.c
 void            binit(void);
+void            bshrink(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwriten(struct buf**, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
 // console.c
 void            consoleinit(void);
-void            consoleintr(int);
+int             consoleintr(int);
 void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+void            execinit(void);
+void            execflush(void);
 
 // file.c
 struct file*    filealloc(void);
@@ -33,6 +38,7 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filesend(struct file*, struct file*, int n);
 
 // fs.c
 void            fsinit(int);
@@ -61,25 +67,50 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+void*           kalloc_order(int);
+void            kfree_order(void *, int);
 void            kfree(void *);
+void            kreclaiminit(void);
+int             kzeroidle(void);
+int             kfreepages(void);
+int             kallocstats(char *, int);
+int             kref(void *);
+int             kdup(void *);
 void            kinit(void);
 
+// ksm.c
+void            ksminit(void);
+void            ksmforget(void *);
+int             ksmrun(int);
+int             ksmstats(char *, int);
+
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+void            log_data(struct buf*);
+void            log_free(uint);
+int             log_freed(uint);
 void            begin_op(void);
 void            end_op(void);
 
+// oom.c
+void            oominit(void);
+int             oomkill(int);
+int             oomstats(char*, int);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             pipewrite(struct pipe*, int, uint64, int);
 
 // printf.c
 int            printf(char*, ...) __attribute__ ((format (printf, 1, 2)));
 void            panic(char*) __attribute__((noreturn));
-void            printfinit(void);
+int             klogflush(char*, int);
+int             klogread(uint64, int);
 
 // proc.c
 int             cpuid(void);
@@ -106,6 +137,10 @@ void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+void            proctlbstale(struct proc*);
+uint64          procsatp(struct proc*);
+void            kthread(void (*)(void), char *);
+extern int      nasid;
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -118,6 +153,20 @@ void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// shm.c
+void            shminit(void);
+uint64          shmmap(char *, int);
+int             shmunlink(char *);
+int             futexwait(uint64, int);
+int             futexwake(uint64);
+
+// slab.c
+void            slabinit(struct slabcache*, char*, int);
+void*           slaballoc(struct slabcache*);
+void            slabfree(struct slabcache*, void*);
+void            slabreclaim(void);
+int             slabstats(char*, int);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -133,6 +182,21 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// swap.c
+void            swapinit(void);
+void            swapdiskinit(void);
+int             swapreclaim(void);
+int             canwait(void);
+int             swapin(uint64, uint64);
+void            swapfree(pte_t);
+int             swapstats(char *, int);
+
+// sprintf.c
+int             snprintf(char *, int, char *, ...);
+
+// stats.c
+void            statsinit(void);
+
 // syscall.c
 void            argint(int, int*);
 int             argstr(int, char*, int);
@@ -143,6 +207,7 @@ void            syscall();
 
 // trap.c
 extern uint     ticks;
+extern int      sysfast;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
@@ -151,14 +216,24 @@ void            usertrapret(void);
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
-void            uartputc(int);
+void            uartwrite(char*, int);
+void            uartkick(void);
+void            uartrxenable(int);
 void            uartputc_sync(int);
 int             uartgetc(void);
 
+// copyuser.S
+int             copyuser(char*, char*, uint64);
+int             copyuserstr(char*, char*, uint64);
+
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
+int             kvmshare(pagetable_t);
+void            kvmunshare(pagetable_t);
+void            kvmswitch(uint64);
+extern pagetable_t kernel_pagetable;
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
@@ -173,6 +248,9 @@ uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
+int             uvmfault(uint64, uint64, int);
+int             uvmfaultuser(uint64, int);
+int             uvmrss(pagetable_t, uint64, uint64);
 
 // plic.c
 void            plicinit(void);
@@ -180,10 +258,21 @@ void            plicinithart(void);
 int             plic_claim(void);
 void            plic_complete(int);
 
+// zram.c
+void            zraminit(void);
+int             zramstore(char *);
+void            zramload(int, char *);
+void            zramfree(int);
+int             zramstats(char *, int);
+
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_writebufs(struct buf **, int);
+void            virtio_disk_rwpages(uint, char **, int, int);
+void            virtio_disk_rwblock(uint, char *, int, int);
 void            virtio_disk_intr(void);
+int             diskstats(char *, int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -3,12 +3,125 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
 
+// Recently exec'd programs, so that running the same
+// commands over and over, as a script does, skips the
+// path lookup. Each entry holds a reference to the i-node,
+// and is keyed by the path and by the directory the lookup
+// started from. unlink() flushes the cache, since that is
+// the only way a path can come to name a different file.
+#define NEXECCACHE 8
+
+struct {
+  struct spinlock lock;
+  uint gen;     // bumped by each flush
+  uint seq;     // for LRU replacement
+  struct {
+    struct inode *ip;   // 0 if unused
+    uint dev;
+    uint dir;           // i-number the lookup started from
+    uint used;
+    char path[MAXPATH];
+  } e[NEXECCACHE];
+} execcache;
+
+void
+execinit(void)
+{
+  initlock(&execcache.lock, "execcache");
+}
+
+// Look up path like namei(), through the cache.
+// Must be called inside a transaction.
+static struct inode*
+execnamei(char *path)
+{
+  struct proc *p = myproc();
+  struct inode *ip, *old;
+  uint dev, dir, gen;
+  int i, v;
+
+  if(*path == '/'){
+    dev = ROOTDEV;
+    dir = ROOTINO;
+  } else {
+    dev = p->cwd->dev;
+    dir = p->cwd->inum;
+  }
+
+  acquire(&execcache.lock);
+  for(i = 0; i < NEXECCACHE; i++){
+    if(execcache.e[i].ip && execcache.e[i].dev == dev && execcache.e[i].dir == dir &&
+       strncmp(execcache.e[i].path, path, MAXPATH) == 0){
+      execcache.e[i].used = ++execcache.seq;
+      ip = idup(execcache.e[i].ip);
+      release(&execcache.lock);
+      return ip;
+    }
+  }
+  gen = execcache.gen;
+  release(&execcache.lock);
+
+  if((ip = namei(path)) == 0)
+    return 0;
+
+  // remember it, unless an unlink() flushed the cache
+  // during the lookup; ip might be stale.
+  old = 0;
+  acquire(&execcache.lock);
+  if(execcache.gen == gen){
+    v = 0;
+    for(i = 0; i < NEXECCACHE; i++){
+      if(execcache.e[i].ip == 0){
+        v = i;
+        break;
+      }
+      if(execcache.e[i].used < execcache.e[v].used)
+        v = i;
+    }
+    old = execcache.e[v].ip;
+    execcache.e[v].ip = idup(ip);
+    execcache.e[v].dev = dev;
+    execcache.e[v].dir = dir;
+    execcache.e[v].used = ++execcache.seq;
+    safestrcpy(execcache.e[v].path, path, MAXPATH);
+  }
+  release(&execcache.lock);
+  if(old)
+    iput(old);
+  return ip;
+}
+
+// Drop every cached program. Called by unlink(),
+// inside its transaction.
+void
+execflush(void)
+{
+  struct inode *ips[NEXECCACHE];
+  int i, n;
+
+  n = 0;
+  acquire(&execcache.lock);
+  execcache.gen++;
+  for(i = 0; i < NEXECCACHE; i++){
+    if(execcache.e[i].ip){
+      ips[n++] = execcache.e[i].ip;
+      execcache.e[i].ip = 0;
+    }
+  }
+  release(&execcache.lock);
+  for(i = 0; i < n; i++)
+    iput(ips[i]);
+}
+
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -33,7 +146,7 @@ exec(char *path, char **argv)
 
   begin_op();
 
-  if((ip = namei(path)) == 0){
+  if((ip = execnamei(path)) == 0){
     end_op();
     return -1;
   }
@@ -123,9 +236,17 @@ exec(char *path, char **argv)
   // Commit to the user image.
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
+  p->asidgen = 0;  // a fresh ASID, with nothing stale in any TLB
   p->sz = sz;
+  p->rss = sz / PGSIZE;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+
+  // the kernel is running on the old page table;
+  // move to the new one before freeing the old.
+  push_off();
+  kvmswitch(procsatp(p));
+  pop_off();
   proc_freepagetable(oldpagetable, oldsz);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
@@ -12,17 +12,19 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
 struct {
-  struct spinlock lock;
-  struct file file[NFILE];
+  struct spinlock lock;  // protects every file's ref
+  struct slabcache cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  slabinit(&ftable.cache, "file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -31,16 +33,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = slaballoc(&ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,9 +66,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  slabfree(&ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -114,9 +110,14 @@ fileread(struct file *f, uint64 addr, int n)
   if(f->type == FD_PIPE){
     r = piperead(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
-    if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
+    if(f->major < 0 || f->major >= NDEV)
+      return -1;
+    if(devsw[f->major].readat)
+      r = devsw[f->major].readat(1, addr, &f->off, n);
+    else if(devsw[f->major].read)
+      r = devsw[f->major].read(1, addr, n);
+    else
       return -1;
-    r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
@@ -130,9 +131,13 @@ fileread(struct file *f, uint64 addr, int n)
 }
 
 // Write to file f.
-// addr is a user virtual address.
-int
-filewrite(struct file *f, uint64 addr, int n)
+// user_src indicates whether addr is a user
+// virtual address or a kernel address.
+// Returns the number of bytes written, which for an
+// i-node is short of n if writei() failed part way,
+// or -1 if none were.
+static int
+dowrite(struct file *f, int user_src, uint64 addr, int n)
 {
   int r, ret = 0;
 
@@ -140,19 +145,20 @@ filewrite(struct file *f, uint64 addr, int n)
     return -1;
 
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, user_src, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    ret = devsw[f->major].write(user_src, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write a chunk at a time to avoid exceeding the
+    // maximum transaction size: MAXOPDATA data blocks,
+    // less 2 blocks of slop for non-aligned writes. the
+    // data doesn't go through the log; the i-node, the
+    // indirect block and the allocation blocks do.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = (MAXOPDATA-2) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
@@ -161,7 +167,7 @@ filewrite(struct file *f, uint64 addr, int n)
 
       begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
+      if ((r = writei(f->ip, user_src, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
       end_op();
@@ -172,7 +178,7 @@ filewrite(struct file *f, uint64 addr, int n)
       }
       i += r;
     }
-    ret = (i == n ? n : -1);
+    ret = (i > 0 || n == 0 ? i : -1);
   } else {
     panic("filewrite");
   }
@@ -180,3 +186,62 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+
+// Write to file f.
+// addr is a user virtual address.
+int
+filewrite(struct file *f, uint64 addr, int n)
+{
+  int r;
+
+  r = dowrite(f, 1, addr, n);
+  if(f->type == FD_INODE && r != n)
+    return -1;  // a short write to an i-node is an error
+  return r;
+}
+
+// Copy up to n bytes from file in, at its offset, to file
+// out, through a kernel buffer rather than user memory.
+// in must be an i-node, whose offset advances by the number
+// of bytes copied. Returns that number, which is short of n
+// at the end of in or if a write fails after some were
+// copied, or -1 if a write fails before any were.
+int
+filesend(struct file *out, struct file *in, int n)
+{
+  char *buf;
+  int r, w, m, tot;
+
+  if(in->readable == 0 || out->writable == 0 || in->type != FD_INODE)
+    return -1;
+  if((buf = kalloc()) == 0)
+    return -1;
+
+  tot = 0;
+  while(tot < n && !killed(myproc())){
+    m = n - tot;
+    if(m > PGSIZE)
+      m = PGSIZE;
+    ilock(in->ip);
+    if((r = readi(in->ip, 0, (uint64)buf, in->off, m)) > 0)
+      in->off += r;
+    iunlock(in->ip);
+    if(r <= 0)
+      break;
+    if((w = dowrite(out, 0, (uint64)buf, r)) != r){
+      // give back what wasn't written.
+      if(w < 0)
+        w = 0;
+      ilock(in->ip);
+      in->off -= r - w;
+      iunlock(in->ip);
+      tot += w;
+      if(tot == 0)
+        tot = -1;
+      break;
+    }
+    tot += r;
+  }
+  kfree(buf);
+  return tot;
+}
@@ -18,6 +18,7 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // in the inode table's list
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -33,8 +34,10 @@ struct inode {
 struct devsw {
   int (*read)(int, uint64, int);
   int (*write)(int, uint64, int);
+  int (*readat)(int, uint64, uint*, int);  // or read at, and advance, the file's offset
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define STATS   2
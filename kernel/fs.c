@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "slab.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
@@ -58,12 +59,26 @@ bzero(int dev, int bno)
   brelse(bp);
 }
 
+// Zero a block of file data, which is written in place
+// rather than through the log.
+static void
+bzerodata(int dev, int bno)
+{
+  struct buf *bp;
+
+  bp = bread(dev, bno);
+  memset(bp->data, 0, BSIZE);
+  log_data(bp);
+  brelse(bp);
+}
+
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Allocate a zeroed disk block, for a file's contents if
+// data is set, or else for metadata.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, int data)
 {
   int b, bi, m;
   struct buf *bp;
@@ -73,11 +88,15 @@ balloc(uint dev)
     bp = bread(dev, BBLOCK(b, sb));
     for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
       m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
+      if((bp->data[bi/8] & m) == 0 &&  // Is block free?
+         !(data && log_freed(b + bi))){
         bp->data[bi/8] |= m;  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
+        if(data)
+          bzerodata(dev, b + bi);
+        else
+          bzero(dev, b + bi);
         return b + bi;
       }
     }
@@ -100,6 +119,7 @@ bfree(int dev, uint b)
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
+  log_free(b);
   log_write(bp);
   brelse(bp);
 }
@@ -129,12 +149,13 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to a table entry (open files and
+//   current directories). iget() finds or creates a table
+//   entry and increments its ref; iput() decrements ref,
+//   and frees the entry when ref reaches zero. entries
+//   come from a slab cache, so the table grows and
+//   shrinks with the number of inodes in use.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
@@ -164,8 +185,8 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
+// The itable.lock spin-lock protects the list of itable
+// entries. Since ip->ref indicates whether an entry is in use,
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold itable.lock while using any of those fields.
 //
@@ -175,18 +196,15 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *list;  // entries in use, through ip->next
+  struct slabcache cache;
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  slabinit(&itable.cache, "inode", sizeof(struct inode));
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -194,10 +212,11 @@ static struct inode* iget(uint dev, uint inum);
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode,
-// or NULL if there is no free inode.
+// or NULL if there is no free inode or no memory for one.
 struct inode*
 ialloc(uint dev, short type)
 {
+  struct inode *ip;
   int inum;
   struct buf *bp;
   struct dinode *dip;
@@ -206,11 +225,15 @@ ialloc(uint dev, short type)
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
+      if((ip = iget(dev, inum)) == 0){
+        brelse(bp);
+        return 0;
+      }
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
-      return iget(dev, inum);
+      return ip;
     }
     brelse(bp);
   }
@@ -243,30 +266,42 @@ iupdate(struct inode *ip)
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
+// Returns 0 if out of memory.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, *nip;
 
+  nip = 0;
   acquire(&itable.lock);
-
-  // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
+  for(;;){
+    // Is the inode already in the table?
+    for(ip = itable.list; ip != 0; ip = ip->next){
+      if(ip->dev == dev && ip->inum == inum){
+        ip->ref++;
+        release(&itable.lock);
+        if(nip)
+          slabfree(&itable.cache, nip);
+        return ip;
+      }
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
-  }
+    if(nip)
+      break;
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+    // allocate without the lock, so that kalloc() can swap
+    // or kill for memory, then look again, since another
+    // process may have added the inode meanwhile.
+    release(&itable.lock);
+    if((nip = slaballoc(&itable.cache)) == 0)
+      return 0;
+    acquire(&itable.lock);
+  }
 
-  ip = empty;
+  // Add an entry.
+  ip = nip;
+  initsleeplock(&ip->lock, "inode");
+  ip->next = itable.list;
+  itable.list = ip;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
@@ -327,8 +362,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry is
+// freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -336,6 +371,8 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+  struct inode **pp;
+
   acquire(&itable.lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
@@ -357,7 +394,14 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0){
+    for(pp = &itable.list; *pp != ip; pp = &(*pp)->next)
+      ;
+    *pp = ip->next;
+    release(&itable.lock);
+    slabfree(&itable.cache, ip);
+    return;
+  }
   release(&itable.lock);
 }
 
@@ -377,17 +421,20 @@ iunlockput(struct inode *ip)
 // listed in block ip->addrs[NDIRECT].
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one. A plain
+// file's blocks are data, written outside the log; a
+// directory's are metadata.
 // returns 0 if out of disk space.
 static uint
 bmap(struct inode *ip, uint bn)
 {
   uint addr, *a;
   struct buf *bp;
+  int data = ip->type == T_FILE;
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, data);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
@@ -399,7 +446,7 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, 0);
       if(addr == 0)
         return 0;
       ip->addrs[NDIRECT] = addr;
@@ -407,7 +454,7 @@ bmap(struct inode *ip, uint bn)
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, data);
       if(addr){
         a[bn] = addr;
         log_write(bp);
@@ -523,7 +570,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
-    log_write(bp);
+    if(ip->type == T_FILE)
+      log_data(bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
 
@@ -546,12 +596,13 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
-// Look for a directory entry in a directory.
+// Look for a directory entry in a directory, and return
+// its inode number, or 0 if there is none.
 // If found, set *poff to byte offset of entry.
-struct inode*
-dirlookup(struct inode *dp, char *name, uint *poff)
+static uint
+dirfind(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
+  uint off;
   struct dirent de;
 
   if(dp->type != T_DIR)
@@ -566,14 +617,26 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       // entry matches path element
       if(poff)
         *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+      return de.inum;
     }
   }
 
   return 0;
 }
 
+// Look for a directory entry in a directory.
+// If found, set *poff to byte offset of entry.
+// Returns 0 if not found, or if out of memory.
+struct inode*
+dirlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint inum;
+
+  if((inum = dirfind(dp, name, poff)) == 0)
+    return 0;
+  return iget(dp->dev, inum);
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 // Returns 0 on success, -1 on failure (e.g. out of disk blocks).
 int
@@ -581,13 +644,11 @@ dirlink(struct inode *dp, char *name, uint inum)
 {
   int off;
   struct dirent de;
-  struct inode *ip;
 
-  // Check that name is not present.
-  if((ip = dirlookup(dp, name, 0)) != 0){
-    iput(ip);
+  // Check that name is not present. (dirlookup() could
+  // fail for want of memory, and miss it.)
+  if(dirfind(dp, name, 0) != 0)
     return -1;
-  }
 
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
@@ -653,9 +714,10 @@ namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
 
-  if(*path == '/')
-    ip = iget(ROOTDEV, ROOTINO);
-  else
+  if(*path == '/'){
+    if((ip = iget(ROOTDEV, ROOTINO)) == 0)
+      return 0;
+  } else
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
@@ -20,10 +20,16 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint swapstart;    // Block number of first swap block
+  uint nswap;        // Number of swap blocks
 };
 
 #define FSMAGIC 0x10203040
 
+// The log's header block names the blocks it logs, so the
+// log can hold at most this many, after the header.
+#define MAXLOG (BSIZE / sizeof(uint) - 3)
+
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
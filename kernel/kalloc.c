@@ -1,6 +1,23 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or blocks of 2^order physically contiguous pages.
+//
+// Free memory is kept in buddy lists: a free block of 2^order
+// pages starts at a page number that is a multiple of 2^order,
+// and a block being freed is merged with its buddy, the other
+// half of the block twice its size, if that is free too.
+// Single pages, the common case, come from a cache on each
+// CPU, which gets and gives back pages in batches.
+//
+// A CPU with nothing to run zeroes free pages ahead of
+// time and keeps them on a list of their own, so that
+// kalloc_zeroed() usually needn't. A kernel thread,
+// kreclaimd, reclaims memory whenever free pages fall
+// below LOWMARK, so that faults seldom find none.
+// Build with KJUNK=1
+// to fill freed and allocated pages with junk, to catch
+// dangling references and uninitialized reads.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +26,13 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define NPHYS ((PHYSTOP - KERNBASE) / PGSIZE)
+#define MAXORDER  10    // largest block: 2^MAXORDER pages (4MB)
+#define PCPBATCH  16    // pages a CPU's cache gets or gives at once
+#define PCPMAX    64    // most pages in a CPU's cache
+#define ZEROMAX   1024  // most pre-zeroed pages to keep
+#define LOWMARK   256   // reclaim when fewer pages than this are free
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -16,17 +40,121 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev;  // in the buddy lists
 };
 
 struct {
-  struct spinlock lock;
-  struct run *freelist;
+  struct spinlock lock;          // the buddy lists and zerolist
+  struct run free[MAXORDER+1];   // circular lists of free blocks
+  int nblock[MAXORDER+1];
+  uchar order[NPHYS];  // order + 1 of a free block starting here, or 0
+  struct run *zerolist;          // pages of zeroes, but for next
+  int nzero;
+  int ref[NPHYS];  // users of each page; see kdup()
+
+  // statistics.
+  int nlow;        // times kreclaimd found free pages below LOWMARK
+  int nfail;       // allocations that failed
 } kmem;
 
+// each CPU's cache of single pages.
+struct {
+  struct spinlock lock;
+  struct run *list;
+  int n;
+} pcp[NCPU];
+
+static int
+pagenum(void *pa)
+{
+  return ((uint64)pa - KERNBASE) / PGSIZE;
+}
+
+static struct run *
+pageaddr(int n)
+{
+  return (struct run *)(KERNBASE + (uint64)n * PGSIZE);
+}
+
+static int *
+refp(void *pa)
+{
+  return &kmem.ref[pagenum(pa)];
+}
+
+// add a free block to list o. kmem.lock must be held.
+static void
+enlist(struct run *r, int o)
+{
+  r->next = kmem.free[o].next;
+  r->prev = &kmem.free[o];
+  r->next->prev = r;
+  kmem.free[o].next = r;
+  kmem.order[pagenum(r)] = o + 1;
+  kmem.nblock[o]++;
+}
+
+static void
+delist(struct run *r, int o)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  kmem.order[pagenum(r)] = 0;
+  kmem.nblock[o]--;
+}
+
+// give the block of 2^o pages at pa back to the buddy lists,
+// merged with its buddies as far as they are free.
+// kmem.lock must be held.
+static void
+buddyfree(void *pa, int o)
+{
+  int pn, bn;
+
+  pn = pagenum(pa);
+  for(; o < MAXORDER; o++){
+    bn = pn ^ (1 << o);
+    if(bn >= NPHYS || kmem.order[bn] != o + 1)
+      break;
+    delist(pageaddr(bn), o);
+    pn &= bn;  // the lower of the two
+  }
+  enlist(pageaddr(pn), o);
+}
+
+// take a block of 2^o pages from the buddy lists, splitting
+// a larger one if need be, or return 0.
+// kmem.lock must be held.
+static void *
+buddyalloc(int o)
+{
+  struct run *r;
+  int k;
+
+  for(k = o; k <= MAXORDER && kmem.free[k].next == &kmem.free[k]; k++)
+    ;
+  if(k > MAXORDER)
+    return 0;
+  r = kmem.free[k].next;
+  delist(r, k);
+  while(k > o){
+    // the upper half is free.
+    k--;
+    enlist((struct run *)((char *)r + ((uint64)PGSIZE << k)), k);
+  }
+  return r;
+}
+
 void
 kinit()
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
+  for(i = 0; i <= MAXORDER; i++)
+    kmem.free[i].next = kmem.free[i].prev = &kmem.free[i];
+  for(i = 0; i < NCPU; i++)
+    initlock(&pcp[i].lock, "kmem cpu");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -34,49 +162,397 @@ void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
+
   p = (char*)PGROUNDUP((uint64)pa_start);
+  acquire(&kmem.lock);
   for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+    buddyfree(p, 0);
+  release(&kmem.lock);
+}
+
+// take a page from this CPU's cache, filling it from the
+// buddy lists if it's empty. returns 0 if there are none.
+static struct run *
+pcpget(void)
+{
+  struct run *r;
+  int i;
+
+  push_off();
+  acquire(&pcp[cpuid()].lock);
+  if(pcp[cpuid()].n == 0){
+    acquire(&kmem.lock);
+    for(i = 0; i < PCPBATCH && (r = buddyalloc(0)) != 0; i++){
+      r->next = pcp[cpuid()].list;
+      pcp[cpuid()].list = r;
+      pcp[cpuid()].n++;
+    }
+    release(&kmem.lock);
+  }
+  if((r = pcp[cpuid()].list) != 0){
+    pcp[cpuid()].list = r->next;
+    pcp[cpuid()].n--;
+  }
+  release(&pcp[cpuid()].lock);
+  pop_off();
+  return r;
+}
+
+// put a page in this CPU's cache, and give a batch
+// back to the buddy lists if it's full.
+static void
+pcpput(struct run *r)
+{
+  int i;
+
+  push_off();
+  acquire(&pcp[cpuid()].lock);
+  r->next = pcp[cpuid()].list;
+  pcp[cpuid()].list = r;
+  if(++pcp[cpuid()].n > PCPMAX){
+    acquire(&kmem.lock);
+    for(i = 0; i < PCPBATCH; i++){
+      r = pcp[cpuid()].list;
+      pcp[cpuid()].list = r->next;
+      pcp[cpuid()].n--;
+      buddyfree(r, 0);
+    }
+    release(&kmem.lock);
+  }
+  release(&pcp[cpuid()].lock);
+  pop_off();
+}
+
+// give back every CPU's cached pages and the zeroed pages,
+// so that they can merge into larger blocks.
+static void
+drain(void)
+{
+  struct run *r;
+  int i;
+
+  for(i = 0; i < NCPU; i++){
+    acquire(&pcp[i].lock);
+    acquire(&kmem.lock);
+    while((r = pcp[i].list) != 0){
+      pcp[i].list = r->next;
+      buddyfree(r, 0);
+    }
+    pcp[i].n = 0;
+    release(&kmem.lock);
+    release(&pcp[i].lock);
+  }
+  acquire(&kmem.lock);
+  while((r = kmem.zerolist) != 0){
+    kmem.zerolist = r->next;
+    buddyfree(r, 0);
+  }
+  kmem.nzero = 0;
+  release(&kmem.lock);
 }
 
 // Free the page of physical memory pointed at by pa,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc().
+// A page that ksm.c has shared is only freed when
+// its last user frees it.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((n = __sync_sub_and_fetch(refp(pa), 1)) > 0)
+    return;
+  if(n < 0)
+    panic("kfree: free");
+  ksmforget(pa);
+
+#ifdef KJUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
-  r = (struct run*)pa;
+  pcpput((struct run*)pa);
+}
+
+// take a page from the zeroed list, or return 0.
+static struct run *
+zeroget(void)
+{
+  struct run *r;
 
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  if((r = kmem.zerolist) != 0){
+    kmem.zerolist = r->next;
+    kmem.nzero--;
+  }
   release(&kmem.lock);
+  return r;
+}
+
+// allocate a page, zeroed if zero is set. prefers a page
+// from the list that matches, but takes either.
+static void *
+alloc(int zero)
+{
+  struct run *r;
+  int z, drained;
+
+  drained = 0;
+  for(;;){
+    r = 0;
+    z = 0;
+    if(zero && (r = zeroget()) != 0)
+      z = 1;
+    else if((r = pcpget()) != 0)
+      z = 0;
+    else if((r = zeroget()) != 0)
+      z = 1;
+    else if(!drained){
+      // other CPUs' caches may still have pages, and
+      // slab.c may have some it isn't using.
+      slabreclaim();
+      drain();
+      drained = 1;
+      continue;
+    }
+
+    // out of memory: page out some user memory, if
+    // the caller is in a position to wait for that.
+    if(r || swapreclaim() == 0)
+      break;
+  }
+  if(r == 0){
+    __sync_fetch_and_add(&kmem.nfail, 1);
+    return 0;
+  }
+
+  if(zero && z)
+    r->next = 0;
+  else if(zero)
+    memset((char*)r, 0, PGSIZE);
+#ifdef KJUNK
+  else
+    memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  *refp(r) = 1;
+  return (void*)r;
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// May sleep to swap memory out, unless the caller
+// holds a spinlock.
 void *
 kalloc(void)
+{
+  return alloc(0);
+}
+
+// Allocate a page of zeroes, as kalloc() does.
+void *
+kalloc_zeroed(void)
+{
+  return alloc(1);
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size. Returns 0 if there is no such block.
+void *
+kalloc_order(int order)
+{
+  void *pa;
+  int i;
+
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  acquire(&kmem.lock);
+  pa = buddyalloc(order);
+  release(&kmem.lock);
+  if(pa == 0){
+    // the pages may be held apart in the caches.
+    drain();
+    acquire(&kmem.lock);
+    pa = buddyalloc(order);
+    release(&kmem.lock);
+  }
+  if(pa == 0)
+    return 0;
+  for(i = 0; i < (1 << order); i++)
+    kmem.ref[pagenum(pa) + i] = 1;
+#ifdef KJUNK
+  memset(pa, 5, (uint64)PGSIZE << order);
+#endif
+  return pa;
+}
+
+// Free a block from kalloc_order().
+void
+kfree_order(void *pa, int order)
+{
+  int i;
+
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > MAXORDER ||
+     ((uint64)pa % ((uint64)PGSIZE << order)) != 0 ||
+     (char*)pa < end || (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_order");
+  for(i = 0; i < (1 << order); i++)
+    kmem.ref[pagenum(pa) + i] = 0;
+#ifdef KJUNK
+  memset(pa, 1, (uint64)PGSIZE << order);
+#endif
+  acquire(&kmem.lock);
+  buddyfree(pa, order);
+  release(&kmem.lock);
+}
+
+// free pages: in the buddy lists, the CPU caches and
+// the zeroed list. kmem.lock must be held.
+static int
+freepages(void)
+{
+  int i, n;
+
+  n = kmem.nzero;
+  for(i = 0; i < NCPU; i++)
+    n += pcp[i].n;
+  for(i = 0; i <= MAXORDER; i++)
+    n += kmem.nblock[i] << i;
+  return n;
+}
+
+// the number of free pages.
+int
+kfreepages(void)
+{
+  int n;
+
+  acquire(&kmem.lock);
+  n = freepages();
+  release(&kmem.lock);
+  return n;
+}
+
+// zero a free page ahead of time, unless ZEROMAX are
+// ready. called by the scheduler when it has nothing to
+// run, a page at a time so that it notices soon when it
+// has. returns 1 if it zeroed one.
+int
+kzeroidle(void)
 {
   struct run *r;
 
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  r = kmem.nzero < ZEROMAX ? buddyalloc(0) : 0;
   release(&kmem.lock);
+  if(r == 0)
+    return 0;
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
-  return (void*)r;
+  memset((char*)r, 0, PGSIZE);
+
+  acquire(&kmem.lock);
+  r->next = kmem.zerolist;
+  kmem.zerolist = r;
+  kmem.nzero++;
+  release(&kmem.lock);
+  return 1;
+}
+
+// once a clock tick, see if free pages are low. if so,
+// drop clean disk blocks and unused slabs, and swap some
+// user memory out.
+static void
+kreclaimd(void)
+{
+  int low;
+
+  for(;;){
+    acquire(&kmem.lock);
+    low = freepages() < LOWMARK;
+    release(&kmem.lock);
+    if(low){
+      kmem.nlow++;
+      bshrink();
+      slabreclaim();
+      swapreclaim();
+    }
+
+    acquire(&tickslock);
+    sleep(&ticks, &tickslock);
+    release(&tickslock);
+  }
+}
+
+void
+kreclaiminit(void)
+{
+  kthread(kreclaimd, "kreclaimd");
+}
+
+// describe free memory, for the statistics device: how
+// much there is, and how it is broken up. the part in
+// blocks smaller than 2^4 pages (64KB) is the part that
+// can't be had contiguously.
+int
+kallocstats(char *buf, int sz)
+{
+  int i, n, ncache, nfree, nsmall, largest;
+
+  ncache = 0;
+  for(i = 0; i < NCPU; i++)
+    ncache += pcp[i].n;
+  acquire(&kmem.lock);
+  nfree = ncache + kmem.nzero;
+  nsmall = nfree;
+  largest = -1;
+  for(i = 0; i <= MAXORDER; i++){
+    nfree += kmem.nblock[i] << i;
+    if(i < 4)
+      nsmall += kmem.nblock[i] << i;
+    if(kmem.nblock[i])
+      largest = i;
+  }
+  n = snprintf(buf, sz, "mem: %d free pages, %d in cpu caches, %d zeroed\n",
+               nfree, ncache, kmem.nzero);
+  n += snprintf(buf + n, sz - n, "buddy: free blocks by order:");
+  for(i = 0; i <= MAXORDER; i++)
+    n += snprintf(buf + n, sz - n, " %d", kmem.nblock[i]);
+  n += snprintf(buf + n, sz - n, "; largest %d pages; %d%% in blocks under 64KB\n",
+                largest < 0 ? 0 : 1 << largest, nfree ? nsmall * 100 / nfree : 0);
+  n += snprintf(buf + n, sz - n, "pressure: %d times below %d free pages; %d failed allocations\n",
+                kmem.nlow, LOWMARK, kmem.nfail);
+  release(&kmem.lock);
+  return n;
+}
+
+// the number of users of page pa.
+int
+kref(void *pa)
+{
+  return *(volatile int *)refp(pa);
+}
+
+// add a user to page pa, unless the last one has
+// already freed it. returns 1, or 0 if it's being freed.
+int
+kdup(void *pa)
+{
+  int *rp = refp(pa);
+  int n;
+
+  do {
+    if((n = *(volatile int *)rp) == 0)
+      return 0;
+  } while(!__sync_bool_compare_and_swap(rp, n, n + 1));
+  return 1;
 }
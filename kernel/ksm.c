@@ -0,0 +1,470 @@
+//
+// same-page merging: a kernel thread, ksmd, that finds
+// user pages with the same contents and has them share
+// one frame, copy on write.
+//
+// ksmd walks each process's pages in turn, a batch per
+// clock tick. a page's contents are hashed and looked up
+// first in the stable table, of frames that are already
+// shared; a match maps that frame in place of the page. a
+// page with no match there is looked up in the unstable
+// table, of pages seen earlier in this pass; if that page
+// still has the same contents, it becomes a stable frame
+// that both share. the unstable table starts empty each
+// pass, since its pages may since have changed.
+//
+// shared frames are read-only. writable ones have PTE_COW
+// set, and a write fault gives the writer its own copy
+// (see uvmfault() in vm.c). a frame leaves the stable
+// table when kfree() frees it, or when its last user is
+// about to write it or page it out (see ksmforget()).
+//
+// ksmd only changes a process's page table while the
+// process waits at one of swap.c's safe points
+// (p->swappable), where the kernel holds no pointers into
+// its memory or its page table, and is frozen (p->frozen),
+// so it can't run then.
+//
+// merging is off until "ksm 1" is written to the statistics
+// device; "ksm 0" turns it off and gives each process its
+// own copies of the pages it shares again.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NSTABLE   4096   // most shared frames
+#define NBUCKET   1024   // stable table hash chains
+#define NCAND     4096   // unstable table slots
+#define KSMBATCH  128    // pages to look at per tick
+#define OFFWAIT   100    // ticks "ksm 0" waits for busy processes
+#define NPHYS     ((PHYSTOP - KERNBASE) / PGSIZE)
+
+extern struct proc proc[NPROC];
+
+struct stable {
+  uint64 hash;
+  char *pa;      // the shared frame
+  int next;      // next in chain or free list, or -1
+};
+
+// a page seen earlier in this pass.
+struct cand {
+  uint64 hash;
+  struct proc *p;
+  int pid;       // p's pid then; 0 if the slot is empty
+  uint64 va;
+};
+
+struct {
+  struct spinlock lock;       // protects the stable table
+  struct stable st[NSTABLE];
+  int bucket[NBUCKET];        // first entry in each chain, or -1
+  int free;                   // first free entry, or -1
+  ushort ent[NPHYS];          // each frame's entry + 1, or 0
+  int nstable;                // entries in use
+
+  // kfree() takes lock while holding p->lock, so sleep()
+  // and wakeup() need a lock of their own.
+  struct spinlock runlock;
+  int run;                    // merging is on
+
+  // only ksmd, or whoever turns merging off, uses these.
+  struct sleeplock scan;      // held while changing page tables
+  struct cand cand[NCAND];
+  int hand;                   // scan position: a process in proc[]
+  uint64 handva;              // and a virtual address in it
+  int npass;                  // passes over every process
+  int nmerge;                 // pages merged
+} ksm;
+
+static int
+pagenum(char *pa)
+{
+  return ((uint64)pa - KERNBASE) / PGSIZE;
+}
+
+// FNV-1a, a word at a time.
+static uint64
+hashpage(char *pa)
+{
+  uint64 *w = (uint64 *)pa;
+  uint64 h = 0xcbf29ce484222325UL;
+  int i;
+
+  for(i = 0; i < PGSIZE / sizeof(uint64); i++)
+    h = (h ^ w[i]) * 0x100000001b3UL;
+  return h;
+}
+
+// find a stable frame with the same contents as page
+// and add a user to it. returns the frame, or 0.
+static char *
+stableget(char *page, uint64 h)
+{
+  struct stable *s;
+  int e;
+
+  acquire(&ksm.lock);
+  for(e = ksm.bucket[h % NBUCKET]; e >= 0; e = s->next){
+    s = &ksm.st[e];
+    // a frame being freed waits in ksmforget() for the
+    // lock, so its contents are still good here.
+    if(s->hash == h && memcmp(s->pa, page, PGSIZE) == 0 && kdup(s->pa)){
+      release(&ksm.lock);
+      return s->pa;
+    }
+  }
+  release(&ksm.lock);
+  return 0;
+}
+
+// add frame pa to the stable table. returns 0, or
+// -1 if the table is full.
+static int
+stableadd(char *pa, uint64 h)
+{
+  struct stable *s;
+  int e;
+
+  acquire(&ksm.lock);
+  if((e = ksm.free) < 0){
+    release(&ksm.lock);
+    return -1;
+  }
+  s = &ksm.st[e];
+  ksm.free = s->next;
+  s->hash = h;
+  s->pa = pa;
+  s->next = ksm.bucket[h % NBUCKET];
+  ksm.bucket[h % NBUCKET] = e;
+  ksm.ent[pagenum(pa)] = e + 1;
+  ksm.nstable++;
+  release(&ksm.lock);
+  return 0;
+}
+
+// take frame pa out of the stable table, if it's there,
+// so that no more users can be added to it. called when
+// it's freed, and before its last user writes it.
+void
+ksmforget(void *pa)
+{
+  int *pp, e;
+
+  if(ksm.ent[pagenum(pa)] == 0)
+    return;
+  acquire(&ksm.lock);
+  if((e = ksm.ent[pagenum(pa)] - 1) >= 0){
+    for(pp = &ksm.bucket[ksm.st[e].hash % NBUCKET]; *pp != e; pp = &ksm.st[*pp].next)
+      ;
+    *pp = ksm.st[e].next;
+    ksm.st[e].next = ksm.free;
+    ksm.free = e;
+    ksm.ent[pagenum(pa)] = 0;
+    ksm.nstable--;
+  }
+  release(&ksm.lock);
+}
+
+// stop q from running while its page table changes. fails
+// if q is running now, or isn't at a safe point, or is no
+// longer process pid (if pid isn't 0). returns 1 if q is
+// now frozen.
+static int
+freeze(struct proc *q, int pid)
+{
+  int ok;
+
+  acquire(&q->lock);
+  ok = (q->state == RUNNABLE || q->state == SLEEPING) && q->swappable &&
+    !q->frozen && q->pagetable != 0 && (pid == 0 || q->pid == pid);
+  if(ok)
+    q->frozen = 1;
+  release(&q->lock);
+  return ok;
+}
+
+static void
+thaw(struct proc *q)
+{
+  acquire(&q->lock);
+  q->frozen = 0;
+  release(&q->lock);
+}
+
+// q's page at va, if it's one ksmd could share, or 0.
+static pte_t *
+mergeable(struct proc *q, uint64 va)
+{
+  pte_t *pte;
+  char *pa;
+
+  if(va >= q->sz || (pte = walk(q->pagetable, va, 0)) == 0)
+    return 0;
+  if((*pte & (PTE_V|PTE_U|PTE_COW|PTE_SHARED)) != (PTE_V|PTE_U))
+    return 0;
+  pa = (char *)PTE2PA(*pte);
+  if(kref(pa) != 1 || ksm.ent[pagenum(pa)] != 0)
+    return 0;  // already shared
+  return pte;
+}
+
+// the flags for a shared frame: read-only, and
+// copied on write if the page was writable.
+static uint64
+sharedflags(pte_t pte)
+{
+  uint64 flags = PTE_FLAGS(pte);
+
+  if(flags & PTE_W)
+    flags = (flags & ~PTE_W) | PTE_COW;
+  return flags;
+}
+
+// map frame pa, which has a user added for q, at pte in
+// place of the page there.
+static void
+share(struct proc *q, pte_t *pte, char *pa)
+{
+  char *old = (char *)PTE2PA(*pte);
+
+  // PTE_COW means PTE_ZRAM in a PTE without PTE_V.
+  if((*pte & PTE_V) == 0)
+    panic("ksm share");
+  *pte = PA2PTE(pa) | sharedflags(*pte);
+  proctlbstale(q);
+  kfree(old);
+  ksm.nmerge++;
+}
+
+// look at frozen process q's page at va: share a frame
+// with the same contents, or remember the page.
+static void
+scanpage(struct proc *q, uint64 va)
+{
+  struct cand *c;
+  struct proc *r;
+  pte_t *pte, *rpte;
+  char *pa, *x;
+  uint64 h;
+  int pid;
+
+  if((pte = mergeable(q, va)) == 0)
+    return;
+  pa = (char *)PTE2PA(*pte);
+  h = hashpage(pa);
+  if((x = stableget(pa, h)) != 0){
+    share(q, pte, x);
+    return;
+  }
+
+  c = &ksm.cand[h % NCAND];
+  if(c->pid == 0 || c->hash != h || (c->p == q && c->va == va)){
+    c->hash = h;
+    c->p = q;
+    c->pid = q->pid;
+    c->va = va;
+    return;
+  }
+
+  // a page seen earlier hashed the same. if its contents
+  // are still the same, its frame becomes a stable frame.
+  r = c->p;
+  pid = c->pid;
+  c->pid = 0;
+  if(r != q && !freeze(r, pid))
+    return;
+  if((rpte = mergeable(r, c->va)) != 0){
+    x = (char *)PTE2PA(*rpte);
+    if(memcmp(x, pa, PGSIZE) == 0 && stableadd(x, h) == 0){
+      // r keeps its frame, now shared.
+      *rpte = PA2PTE(x) | sharedflags(*rpte);
+      proctlbstale(r);
+      kdup(x);
+      share(q, pte, x);
+    }
+  }
+  if(r != q)
+    thaw(r);
+}
+
+// look at up to KSMBATCH pages, going on from
+// ksm.hand and ksm.handva.
+static void
+scanbatch(void)
+{
+  struct proc *q;
+  int n;
+
+  for(n = 0; n < KSMBATCH; n++){
+    q = &proc[ksm.hand];
+    if(freeze(q, 0)){
+      for(; ksm.handva < q->sz && n < KSMBATCH; ksm.handva += PGSIZE, n++)
+        scanpage(q, ksm.handva);
+      thaw(q);
+      if(ksm.handva < q->sz)
+        return;  // go on with q next time
+    }
+    ksm.handva = 0;
+    if(++ksm.hand == NPROC){
+      ksm.hand = 0;
+      ksm.npass++;
+      memset(ksm.cand, 0, sizeof(ksm.cand));
+    }
+  }
+}
+
+static void
+ksmd(void)
+{
+  for(;;){
+    acquire(&ksm.runlock);
+    while(!ksm.run)
+      sleep(&ksm.run, &ksm.runlock);
+    release(&ksm.runlock);
+
+    acquiresleep(&ksm.scan);
+    if(ksm.run)
+      scanbatch();
+    releasesleep(&ksm.scan);
+
+    acquire(&tickslock);
+    sleep(&ticks, &tickslock);
+    release(&tickslock);
+  }
+}
+
+// give q its own copy of each page it shares.
+// returns 0, or -1 if out of memory.
+static int
+unmerge(struct proc *q)
+{
+  pte_t *pte;
+  char *pa, *mem;
+  uint64 va, flags;
+
+  for(va = 0; va < q->sz; va += PGSIZE){
+    pte = walk(q->pagetable, va, 0);
+    if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_SHARED)) != (PTE_V|PTE_U))
+      continue;
+    pa = (char *)PTE2PA(*pte);
+    if((*pte & PTE_COW) == 0 && kref(pa) == 1 && ksm.ent[pagenum(pa)] == 0)
+      continue;
+    if((mem = kalloc()) == 0)
+      return -1;
+    pa = (char *)PTE2PA(*pte);  // kalloc() may have slept
+    memmove(mem, pa, PGSIZE);
+    flags = PTE_FLAGS(*pte);
+    if(flags & PTE_COW)
+      flags = (flags & ~PTE_COW) | PTE_W;
+    *pte = PA2PTE(mem) | flags;
+    proctlbstale(q);
+    kfree(pa);
+  }
+  return 0;
+}
+
+// unmerge every process. one that isn't at a safe point
+// is tried again a tick later, for OFFWAIT ticks; after
+// that its pages stay shared, copy on write, which is still
+// correct. zombies are left to be freed. returns 0, or -1
+// if out of memory or killed.
+static int
+unmergeall(void)
+{
+  struct proc *q, *p = myproc();
+  uint ticks0 = ticks;
+  int busy;
+
+  for(;;){
+    busy = 0;
+    for(q = proc; q < &proc[NPROC]; q++){
+      if(q == p){
+        if(unmerge(q) < 0)
+          return -1;
+      } else if(freeze(q, 0)){
+        if(unmerge(q) < 0){
+          thaw(q);
+          return -1;
+        }
+        thaw(q);
+      } else {
+        acquire(&q->lock);
+        if(q->pagetable != 0 && q->state != ZOMBIE && q->state != USED)
+          busy = 1;
+        release(&q->lock);
+      }
+    }
+    if(!busy || ksm.nstable == 0)
+      return 0;
+    if(killed(p))
+      return -1;
+    acquire(&tickslock);
+    if(ticks - ticks0 >= OFFWAIT){
+      release(&tickslock);
+      return 0;
+    }
+    sleep(&ticks, &tickslock);
+    release(&tickslock);
+  }
+}
+
+// turn merging on or off. returns 0, or -1 if
+// unmerging failed.
+int
+ksmrun(int on)
+{
+  int r = 0;
+
+  acquiresleep(&ksm.scan);
+  acquire(&ksm.runlock);
+  ksm.run = on;
+  wakeup(&ksm.run);
+  release(&ksm.runlock);
+  if(!on)
+    r = unmergeall();
+  releasesleep(&ksm.scan);
+  return r;
+}
+
+void
+ksminit(void)
+{
+  int i;
+
+  initlock(&ksm.lock, "ksm");
+  initlock(&ksm.runlock, "ksmrun");
+  initsleeplock(&ksm.scan, "ksmscan");
+  for(i = 0; i < NBUCKET; i++)
+    ksm.bucket[i] = -1;
+  for(i = 0; i < NSTABLE; i++)
+    ksm.st[i].next = i + 1;
+  ksm.st[NSTABLE-1].next = -1;
+  ksm.free = 0;
+  kthread(ksmd, "ksmd");
+}
+
+// describe merging, for the statistics device.
+int
+ksmstats(char *buf, int sz)
+{
+  int i, e, users;
+
+  users = 0;
+  acquire(&ksm.lock);
+  for(i = 0; i < NBUCKET; i++)
+    for(e = ksm.bucket[i]; e >= 0; e = ksm.st[e].next)
+      users += kref(ksm.st[e].pa);
+  i = snprintf(buf, sz, "ksm: %s; %d shared frames, %d users, %d pages saved; %d merges in %d passes\n",
+               ksm.run ? "on" : "off", ksm.nstable, users, users - ksm.nstable,
+               ksm.nmerge, ksm.npass);
+  release(&ksm.lock);
+  return i;
+}
@@ -23,50 +23,108 @@
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+//   header block, containing a sequence number, block #s for
+//     block A, B, C, ..., and a checksum
 //   block A
 //   block B
 //   block C
 //   ...
 // Log appends are synchronous.
+//
+// The checksum covers the header and the logged blocks, so
+// the header can be written in the same disk request as the
+// blocks: recovery only believes a header whose checksum
+// matches the log. Nor is the header cleared once the
+// transaction is installed. Recovery replays it again,
+// which is harmless, since each block it logged has been
+// written since only by a later transaction, which wrote a
+// new header, or as the data of a transaction that never
+// committed; or the next commit has begun to overwrite the
+// log, and the checksum no longer matches.
+//
+// commit() doesn't install the transaction itself. It leaves
+// the logged buffers pinned, and the flusher thread copies
+// the blocks from the log to their home locations, in block
+// order, while FS system calls go on. It writes the log's
+// copies, not the cached buffers, which may by then hold
+// changes of the transaction in progress: were those to
+// reach their home locations, and the next commit to crash
+// part way through overwriting the log, nothing would undo
+// them. The next commit waits for the flusher to finish
+// before it writes anything.
+//
+// Only metadata goes through the log. The contents of files
+// are written once, in place, just before the transaction
+// commits (see log_data()), so that a committed inode never
+// points at blocks whose data isn't on disk. A block freed
+// in a transaction is not given out again as file data until
+// the transaction commits, since until then a crash would
+// leave it belonging to the file it was freed from.
+
+// mkfs sets the size of the log. Each FS system call in
+// progress reserves MAXOPBLOCKS of it, and MAXOPDATA file
+// data blocks, of which a transaction can have as many as
+// it has room for calls.
+#define MAXDATA (MAXLOG / MAXOPBLOCKS * MAXOPDATA)
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  uint seq;      // which transaction
+  uint cksum;    // of the above and the logged blocks
+  int block[MAXLOG];
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks in the log, with the header
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
   int dev;
   struct logheader lh;
+  int ndata;             // file data blocks to write before commit
+  int maxdata;
+  int data[MAXDATA];
+  struct buf *dbufs[MAXDATA];  // for write_data()
+  struct buf *bufs[MAXLOG+1];  // for write_log()
+  int ninstall;          // committed blocks for the flusher to install
+  int install[MAXLOG];   // their home locations, by log slot
+  int order[MAXLOG];     // the slots, in block order
+  struct buf ibuf;       // a log block on its way home
+  int nfreed;            // blocks freed in this transaction
+  uchar freed[FSSIZE/8];
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void flusher(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  if (sizeof(struct logheader) > BSIZE)
     panic("initlog: too big logheader");
+  if (sb->nlog < MAXOPBLOCKS+1 || sb->nlog > MAXLOG+1)
+    panic("initlog: bad log size");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  log.maxdata = (log.size-1) / MAXOPBLOCKS * MAXOPDATA;
   log.dev = dev;
+  initsleeplock(&log.ibuf.lock, "install");
+  log.ibuf.dev = dev;
   recover_from_log();
+  kthread(flusher, "flusher");
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location,
+// when recovering
 static void
-install_trans(int recovering)
+install_trans(void)
 {
   int tail;
 
@@ -75,13 +133,34 @@ install_trans(int recovering)
     struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
     memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
     bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
     brelse(lbuf);
     brelse(dbuf);
   }
 }
 
+// Fold n bytes into checksum h (32-bit FNV-1a).
+static uint
+cksum(uint h, void *p, int n)
+{
+  uchar *c = p;
+
+  while(n-- > 0)
+    h = (h ^ *c++) * 16777619;
+  return h;
+}
+
+// Checksum of the header's sequence number and block #s,
+// to which the logged blocks are added.
+static uint
+headsum(struct logheader *lh)
+{
+  uint h = 2166136261;
+
+  h = cksum(h, &lh->seq, sizeof(lh->seq));
+  h = cksum(h, &lh->n, sizeof(lh->n));
+  return cksum(h, lh->block, lh->n * sizeof(lh->block[0]));
+}
+
 // Read the log header from disk into the in-memory log header
 static void
 read_head(void)
@@ -90,36 +169,42 @@ read_head(void)
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
   log.lh.n = lh->n;
+  log.lh.seq = lh->seq;
+  log.lh.cksum = lh->cksum;
+  if (log.lh.n < 0 || log.lh.n > MAXLOG || log.lh.n >= log.size)
+    log.lh.n = 0;  // garbage; not a header
   for (i = 0; i < log.lh.n; i++) {
     log.lh.block[i] = lh->block[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void
-write_head(void)
+// Does the log on disk hold the whole of the
+// transaction its header describes?
+static int
+committed(void)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  uint h;
+  int tail;
+
+  if (log.lh.n == 0)
+    return 0;
+  h = headsum(&log.lh);
+  for (tail = 0; tail < log.lh.n; tail++) {
+    struct buf *lbuf = bread(log.dev, log.start+tail+1);
+    h = cksum(h, lbuf->data, BSIZE);
+    brelse(lbuf);
   }
-  bwrite(buf);
-  brelse(buf);
+  return h == log.lh.cksum;
 }
 
 static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
+  if (committed())
+    install_trans(); // copy from log to disk
   log.lh.n = 0;
-  write_head(); // clear the log
 }
 
 // called at the start of each FS system call.
@@ -130,7 +215,8 @@ begin_op(void)
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > log.size-1 ||
+              log.ndata + (log.outstanding+1)*MAXOPDATA > log.maxdata){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
@@ -174,34 +260,151 @@ end_op(void)
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy modified blocks from cache to log, and write them
+// and the header, with the next sequence number and the
+// checksum, to disk together: the real commit.
 static void
 write_log(void)
 {
-  int tail;
+  struct buf **bufs = log.bufs;
+  struct logheader *hb;
+  uint h;
+  int tail, i;
 
+  log.lh.seq++;
+  h = headsum(&log.lh);
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *to = bread(log.dev, log.start+tail+1); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    h = cksum(h, to->data, BSIZE);
     brelse(from);
-    brelse(to);
+    bufs[tail+1] = to;
+  }
+  log.lh.cksum = h;
+
+  bufs[0] = bread(log.dev, log.start);
+  hb = (struct logheader *) (bufs[0]->data);
+  hb->n = log.lh.n;
+  hb->seq = log.lh.seq;
+  hb->cksum = log.lh.cksum;
+  for (i = 0; i < log.lh.n; i++) {
+    hb->block[i] = log.lh.block[i];
+  }
+  bwriten(bufs, log.lh.n+1);
+  for (i = 0; i <= log.lh.n; i++)
+    brelse(bufs[i]);
+}
+
+// Write file data blocks in place, all together, so that
+// the disk queue can merge runs of them.
+static void
+write_data(void)
+{
+  int i;
+
+  for (i = 0; i < log.ndata; i++)
+    log.dbufs[i] = bread(log.dev, log.data[i]);
+  bwriten(log.dbufs, log.ndata);
+  for (i = 0; i < log.ndata; i++) {
+    bunpin(log.dbufs[i]);
+    brelse(log.dbufs[i]);
+  }
+  log.ndata = 0;
+}
+
+// Wait for the flusher to install the last committed
+// transaction, so that the log can be reused, and so that
+// its copy of a block since freed and made file data
+// can't land on top of the data.
+static void
+waitinstall(void)
+{
+  acquire(&log.lock);
+  while (log.ninstall > 0)
+    sleep(&log.ninstall, &log.lock);
+  release(&log.lock);
+}
+
+// The flusher thread: copy each committed transaction's
+// blocks from the log to their home locations, in block
+// order, then unpin their buffers and let the log be reused.
+static void
+flusher(void)
+{
+  int i, j, n, s;
+
+  for (;;) {
+    acquire(&log.lock);
+    while (log.ninstall == 0)
+      sleep(&log.ninstall, &log.lock);
+    n = log.ninstall;
+    release(&log.lock);
+
+    // log.install doesn't change until ninstall is 0 again.
+    for (i = 0; i < n; i++) {
+      s = i;
+      for (j = i; j > 0 && log.install[log.order[j-1]] > log.install[s]; j--)
+        log.order[j] = log.order[j-1];
+      log.order[j] = s;
+    }
+    acquiresleep(&log.ibuf.lock);
+    for (i = 0; i < n; i++) {
+      s = log.order[i];
+      struct buf *lbuf = bread(log.dev, log.start+s+1);
+      memmove(log.ibuf.data, lbuf->data, BSIZE);
+      brelse(lbuf);
+      log.ibuf.blockno = log.install[s];
+      bwrite(&log.ibuf);
+      struct buf *b = bread(log.dev, log.install[s]);
+      bunpin(b);
+      brelse(b);
+    }
+    releasesleep(&log.ibuf.lock);
+
+    acquire(&log.lock);
+    log.ninstall = 0;
+    wakeup(&log.ninstall);
+    release(&log.lock);
   }
 }
 
 static void
 commit()
 {
+  waitinstall();     // The last transaction may still be going home
+  write_data();      // File data first, before the metadata that refers to it
   if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    write_log();     // Write modified blocks and header to log -- the real commit
+    acquire(&log.lock);
+    memmove(log.install, log.lh.block, log.lh.n * sizeof(log.lh.block[0]));
+    log.ninstall = log.lh.n;  // Now the flusher installs them
+    wakeup(&log.ninstall);
+    release(&log.lock);
+    log.lh.n = 0;    // The header on disk stays; see above
+  }
+  if (log.nfreed > 0) {
+    memset(log.freed, 0, sizeof(log.freed));
+    log.nfreed = 0;
   }
 }
 
+// remove block from the file data list, if it's there.
+// returns 1 if it was. caller holds log.lock.
+static int
+undata(int blockno)
+{
+  int i;
+
+  for (i = 0; i < log.ndata; i++) {
+    if (log.data[i] == blockno) {
+      log.data[i] = log.data[--log.ndata];
+      return 1;
+    }
+  }
+  return 0;
+}
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
 // commit()/write_log() will do the disk write.
@@ -217,7 +420,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.size - 1)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -228,9 +431,61 @@ log_write(struct buf *b)
   }
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
-    bpin(b);
+    if (!undata(b->blockno))  // file data turned metadata is pinned already
+      bpin(b);
     log.lh.n++;
   }
   release(&log.lock);
 }
 
+// Caller has modified b->data, a block of a file's contents,
+// and is done with the buffer. Like log_write(), but commit()
+// writes the block to its home location, before the log,
+// rather than through the log.
+void
+log_data(struct buf *b)
+{
+  int i;
+
+  acquire(&log.lock);
+  if (log.outstanding < 1)
+    panic("log_data outside of trans");
+  for (i = 0; i < log.lh.n; i++) {
+    if (log.lh.block[i] == b->blockno) {  // logged already
+      release(&log.lock);
+      return;
+    }
+  }
+  for (i = 0; i < log.ndata; i++) {
+    if (log.data[i] == b->blockno)
+      break;
+  }
+  if (i == log.ndata) {
+    if (log.ndata >= log.maxdata)
+      panic("too much data in a transaction");
+    bpin(b);
+    log.data[log.ndata++] = b->blockno;
+  }
+  release(&log.lock);
+}
+
+// Block b is being freed in the current transaction.
+// Caller holds the buffer of b's bitmap block.
+void
+log_free(uint b)
+{
+  if (b >= FSSIZE)
+    panic("log_free");
+  log.freed[b/8] |= 1 << (b%8);
+  __sync_fetch_and_add(&log.nfreed, 1);
+}
+
+// Was block b freed in the current transaction, so that
+// it can't yet be file data? Caller holds the buffer of
+// b's bitmap block.
+int
+log_freed(uint b)
+{
+  return b < FSSIZE && (log.freed[b/8] & (1 << (b%8)));
+}
+
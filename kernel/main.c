@@ -12,7 +12,6 @@ main()
 {
   if(cpuid() == 0){
     consoleinit();
-    printfinit();
     printf("\n");
     printf("xv6 kernel is booting\n");
     printf("\n");
@@ -27,8 +26,16 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    execinit();      // exec path cache
+    swapinit();      // swap space
+    statsinit();     // statistics device
+    shminit();       // shared memory segments
+    oominit();       // out-of-memory killer
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
+    ksminit();       // page merging thread
+    kreclaiminit();  // memory reclaiming thread
     __sync_synchronize();
     started = 1;
   } else {
@@ -47,6 +47,10 @@
 // each surrounded by invalid guard pages.
 #define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
 
+// user memory stays below the PLIC, so that a user page
+// table can also map the kernel (see kvmshare() in vm.c).
+#define MAXUVA PLIC
+
 // User memory layout.
 // Address zero first:
 //   text
@@ -0,0 +1,176 @@
+//
+// the out-of-memory killer.
+//
+// when a page fault or fork() can't get memory, even after
+// kalloc() has tried swapping, oomkill() kills the process
+// with the most resident pages, and waits for it to exit and
+// give them back, rather than the fault or fork failing in
+// whichever process happened to ask (often sh). a fault in
+// copyin() or copyout() starts the kill but fails rather
+// than waiting, since it may hold locks the victim needs.
+// explicit requests for memory, sbrk() and exec(), still
+// just fail.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define OOMWAIT 10   // ticks to wait for a victim to exit
+
+extern struct proc proc[NPROC];
+extern struct proc *initproc;
+
+struct {
+  struct spinlock lock;
+  struct proc *victim;  // the last one killed
+  int pid;              // and its pid
+
+  // statistics.
+  int nkill;
+  char name[16];        // the last victim's
+  int rss;              // and its resident pages
+} oom;
+
+void
+oominit(void)
+{
+  initlock(&oom.lock, "oom");
+}
+
+// has q, killed when it had pid, exited?
+static int
+gone(struct proc *q, int pid)
+{
+  int r;
+
+  acquire(&q->lock);
+  r = q->pid != pid || q->state == ZOMBIE || q->state == UNUSED;
+  release(&q->lock);
+  return r;
+}
+
+// can q be killed to free memory?
+static int
+killable(struct proc *q)
+{
+  return q != initproc && q->pagetable != 0 && !q->killed &&
+    (q->state == SLEEPING || q->state == RUNNABLE || q->state == RUNNING);
+}
+
+// the user process with the most resident pages, with its
+// lock held, or 0.
+static struct proc *
+largest(void)
+{
+  struct proc *q, *big;
+  int most;
+
+  for(;;){
+    big = 0;
+    most = -1;
+    for(q = proc; q < &proc[NPROC]; q++){
+      acquire(&q->lock);
+      if(killable(q) && q->rss > most){
+        big = q;
+        most = q->rss;
+      }
+      release(&q->lock);
+    }
+    if(big == 0)
+      return 0;
+    acquire(&big->lock);
+    if(killable(big))
+      return big;
+    release(&big->lock);  // it exited meanwhile
+  }
+}
+
+// called when memory for a fault or fork() can't be found.
+// kills the largest process, unless one killed earlier
+// hasn't exited yet, and, if wait is set, waits up to
+// OOMWAIT ticks for it to exit. returns 1 if the caller
+// should try again, or 0 if it should fail: it can't or
+// mustn't wait, it is the one being killed, or the victim
+// didn't exit in time. a caller that may hold a lock the
+// victim needs to exit, such as an inode's, mustn't wait.
+int
+oomkill(int wait)
+{
+  struct proc *p = myproc(), *q;
+  char name[16];
+  uint ticks0;
+  int pid, rss, killed1 = 0;
+
+  if(!canwait())
+    return 0;
+
+  acquire(&oom.lock);
+  if(oom.victim == 0 || gone(oom.victim, oom.pid)){
+    if((q = largest()) == 0){
+      release(&oom.lock);
+      return 0;
+    }
+    q->killed = 1;
+    if(q->state == SLEEPING)
+      q->state = RUNNABLE;
+    oom.victim = q;
+    oom.pid = q->pid;
+    oom.nkill++;
+    oom.rss = q->rss;
+    safestrcpy(oom.name, q->name, sizeof(oom.name));
+    safestrcpy(name, q->name, sizeof(name));
+    rss = q->rss;
+    release(&q->lock);
+    killed1 = 1;
+  }
+  q = oom.victim;
+  pid = oom.pid;
+  release(&oom.lock);
+
+  // printf() takes the UART's lock, which a victim writing
+  // to the console holds while it takes its p->lock.
+  if(killed1)
+    printf("oom: killed pid %d (%s) with %d resident pages\n", pid, name, rss);
+
+  if(q == p || !wait)
+    return 0;
+
+  // exit() frees the victim's memory. let others take
+  // this process's pages meanwhile.
+  acquire(&tickslock);
+  ticks0 = ticks;
+  release(&tickslock);
+  while(!gone(q, pid) && !killed(p)){
+    acquire(&tickslock);
+    if(ticks - ticks0 >= OOMWAIT){
+      release(&tickslock);
+      break;
+    }
+    p->swappable = 1;
+    sleep(&ticks, &tickslock);
+    p->swappable = 0;
+    release(&tickslock);
+  }
+  return gone(q, pid) && !killed(p);
+}
+
+// describe the killer, for the statistics device.
+int
+oomstats(char *buf, int sz)
+{
+  int n;
+
+  acquire(&oom.lock);
+  if(oom.nkill == 0)
+    n = snprintf(buf, sz, "oom: 0 kills\n");
+  else
+    n = snprintf(buf, sz, "oom: %d kills; last pid %d (%s) with %d resident pages\n",
+                 oom.nkill, oom.pid, oom.name, oom.rss);
+  release(&oom.lock);
+  return n;
+}
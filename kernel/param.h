@@ -5,14 +5,14 @@
 #endif
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // active i-nodes usertests expects to hold
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGSIZE      (MAXOPBLOCKS*10)  // blocks in on-disk log, by default
+#define MAXOPDATA    64  // max # of file data blocks any FS op writes
+#define NBUF         (MAXOPBLOCKS*3)  // fewest blocks the disk block cache keeps
 #ifdef LAB_FS
 #define FSSIZE       200000  // size of file system in blocks
 #else
@@ -23,6 +23,11 @@
 #endif
 #endif
 #define MAXPATH      128   // maximum file path name
+#define KLOGSIZE     16384 // bytes of kernel log, as dmesg reads it
+#define NSHM         16    // shared memory segments per system
+#define SHMMAXPG     256   // maximum pages in a segment
+#define SHMNAME      16    // maximum segment name length
+#define SWAPBLOCKS   (256*1024)  // size of swap area in blocks, after the file system
 
 #ifdef LAB_UTIL
 #define USERSTACK    2     // user stack pages
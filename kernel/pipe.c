@@ -7,6 +7,7 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "slab.h"
 
 #define PIPESIZE 512
 
@@ -19,6 +20,14 @@ struct pipe {
   int writeopen;  // write fd is still open
 };
 
+static struct slabcache pipecache;
+
+void
+pipeinit(void)
+{
+  slabinit(&pipecache, "pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,7 +37,7 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = slaballoc(&pipecache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
@@ -47,7 +56,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    slabfree(&pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,15 +77,17 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    slabfree(&pipecache, pi);
   } else
     release(&pi->lock);
 }
 
+// user_src indicates whether addr is a user
+// virtual address or a kernel address.
 int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+pipewrite(struct pipe *pi, int user_src, uint64 addr, int n)
 {
-  int i = 0;
+  int i = 0, m;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
@@ -89,11 +100,24 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
-        break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      // copy as much as fits before the buffer wraps.
+      m = n - i;
+      if(m > pi->nread + PIPESIZE - pi->nwrite)
+        m = pi->nread + PIPESIZE - pi->nwrite;
+      if(m > PIPESIZE - pi->nwrite % PIPESIZE)
+        m = PIPESIZE - pi->nwrite % PIPESIZE;
+      if(either_copyin(&pi->data[pi->nwrite % PIPESIZE], user_src, addr + i, m) == -1){
+        // the source may be out on swap; read it in
+        // without the lock held, and look again.
+        release(&pi->lock);
+        m = user_src ? uvmfault(addr + i, m, 0) : 0;
+        acquire(&pi->lock);
+        if(m <= 0)
+          break;
+        continue;
+      }
+      pi->nwrite += m;
+      i += m;
     }
   }
   wakeup(&pi->nread);
@@ -105,9 +129,8 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, m;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
@@ -117,12 +140,24 @@ piperead(struct pipe *pi, uint64 addr, int n)
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
-      break;
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += m){  //DOC: piperead-copy
+    // copy as much as is contiguous in the buffer.
+    m = n - i;
+    if(m > pi->nwrite - pi->nread)
+      m = pi->nwrite - pi->nread;
+    if(m > PIPESIZE - pi->nread % PIPESIZE)
+      m = PIPESIZE - pi->nread % PIPESIZE;
+    if(copyout(pr->pagetable, addr + i, &pi->data[pi->nread % PIPESIZE], m) == -1){
+      // as in pipewrite().
+      release(&pi->lock);
+      m = uvmfault(addr + i, m, 1);
+      acquire(&pi->lock);
+      if(m <= 0)
+        break;
+      m = 0;
+      continue;
+    }
+    pi->nread += m;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
@@ -17,16 +17,73 @@
 
 volatile int panicked = 0;
 
-// lock to avoid interleaving concurrent printf's.
+// set by panic(), so that printf() writes straight
+// to the UART rather than waiting for interrupts.
+static volatile int panicking = 0;
+
+// the kernel log: a ring of the most recent printf() output.
+// writers claim space with an atomic add on reserve, fill it
+// in, and then publish it by advancing commit, in the same order
+// they claimed it. no lock is needed, and printf() never waits
+// for the UART. uartstart() drains the log, from interrupts,
+// through flushed. KLOGSIZE is in param.h, for dmesg.
 static struct {
-  struct spinlock lock;
-  int locking;
-} pr;
+  char buf[KLOGSIZE];
+  uint64 reserve;          // next byte a writer will claim
+  volatile uint64 commit;  // bytes before commit are complete
+  uint64 flushed;          // bytes before flushed went to the UART
+} klog;
 
 static char digits[] = "0123456789abcdef";
 
+// printf() collects its output here, so that it can
+// append to the log in a few large pieces.
+struct pbuf {
+  char buf[128];
+  int n;
+};
+
 static void
-printint(long long xx, int base, int sign)
+klogwrite(char *s, int n)
+{
+  uint64 start;
+  int i;
+
+  if(n > KLOGSIZE)
+    n = KLOGSIZE;
+
+  // with interrupts off, no writer on this CPU can
+  // wait for us to publish.
+  push_off();
+  start = __sync_fetch_and_add(&klog.reserve, n);
+  for(i = 0; i < n; i++)
+    klog.buf[(start + i) % KLOGSIZE] = s[i];
+
+  // wait for earlier writers to publish, then publish.
+  while(klog.commit != start)
+    ;
+  __sync_synchronize();
+  klog.commit = start + n;
+  pop_off();
+}
+
+static void
+pflush(struct pbuf *pb)
+{
+  klogwrite(pb->buf, pb->n);
+  pb->n = 0;
+}
+
+static void
+pputc(struct pbuf *pb, int c)
+{
+  if(pb->n == sizeof(pb->buf))
+    pflush(pb);
+  pb->buf[pb->n++] = c;
+}
+
+static void
+printint(struct pbuf *pb, long long xx, int base, int sign)
 {
   char buf[16];
   int i;
@@ -46,35 +103,106 @@ printint(long long xx, int base, int sign)
     buf[i++] = '-';
 
   while(--i >= 0)
-    consputc(buf[i]);
+    pputc(pb, buf[i]);
 }
 
 static void
-printptr(uint64 x)
+printptr(struct pbuf *pb, uint64 x)
 {
   int i;
-  consputc('0');
-  consputc('x');
+  pputc(pb, '0');
+  pputc(pb, 'x');
   for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4)
-    consputc(digits[x >> (sizeof(uint64) * 8 - 4)]);
+    pputc(pb, digits[x >> (sizeof(uint64) * 8 - 4)]);
+}
+
+// copy up to n log bytes that haven't yet been sent
+// to the UART into dst, and mark them as sent.
+// if writers have lapped the UART, skip the lost bytes.
+// caller must hold uart_tx_lock, which protects klog.flushed.
+int
+klogflush(char *dst, int n)
+{
+  uint64 commit = klog.commit;
+  int i;
+
+  __sync_synchronize();
+  if(commit - klog.flushed > KLOGSIZE)
+    klog.flushed = commit - KLOGSIZE;
+  for(i = 0; i < n && klog.flushed < commit; i++)
+    dst[i] = klog.buf[klog.flushed++ % KLOGSIZE];
+  return i;
+}
+
+// send all unsent log bytes to the UART, spinning.
+// only for panic(), when interrupts may never come.
+static void
+klogsync(void)
+{
+  while(klog.flushed < klog.commit)
+    uartputc_sync(klog.buf[klog.flushed++ % KLOGSIZE]);
+}
+
+// copy the most recent (up to n) bytes of the
+// kernel log to user address dst.
+// returns the number of bytes copied, or -1.
+int
+klogread(uint64 dst, int n)
+{
+  char buf[64];
+  uint64 commit, start, off, reserve;
+  int m;
+
+  commit = klog.commit;
+  __sync_synchronize();
+  if(n < 0)
+    return -1;
+  if(n > KLOGSIZE)
+    n = KLOGSIZE;
+  if(n > commit)
+    n = commit;
+  start = commit - n;
+
+again:
+  for(off = start; off < commit; off += m){
+    m = commit - off;
+    if(m > sizeof(buf))
+      m = sizeof(buf);
+    for(int i = 0; i < m; i++)
+      buf[i] = klog.buf[(off + i) % KLOGSIZE];
+
+    // if writers have claimed the space these bytes
+    // were in, they may be torn. start again later in
+    // the log, leaving the writers half the ring.
+    reserve = __sync_fetch_and_add(&klog.reserve, 0);
+    if(reserve - off > KLOGSIZE){
+      start = reserve - KLOGSIZE / 2;
+      if(start > commit)
+        start = commit;
+      goto again;
+    }
+    if(copyout(myproc()->pagetable, dst + (off - start), buf, m) < 0)
+      return -1;
+  }
+  return commit - start;
 }
 
 // Print to the console.
+// takes no locks, so it may be
+// called with any spinlock held, including a p->lock.
 int
 printf(char *fmt, ...)
 {
   va_list ap;
-  int i, cx, c0, c1, c2, locking;
+  int i, cx, c0, c1, c2;
   char *s;
+  struct pbuf pb;
 
-  locking = pr.locking;
-  if(locking)
-    acquire(&pr.lock);
-
+  pb.n = 0;
   va_start(ap, fmt);
   for(i = 0; (cx = fmt[i] & 0xff) != 0; i++){
     if(cx != '%'){
-      consputc(cx);
+      pputc(&pb, cx);
       continue;
     }
     i++;
@@ -83,44 +211,44 @@ printf(char *fmt, ...)
     if(c0) c1 = fmt[i+1] & 0xff;
     if(c1) c2 = fmt[i+2] & 0xff;
     if(c0 == 'd'){
-      printint(va_arg(ap, int), 10, 1);
+      printint(&pb, va_arg(ap, int), 10, 1);
     } else if(c0 == 'l' && c1 == 'd'){
-      printint(va_arg(ap, uint64), 10, 1);
+      printint(&pb, va_arg(ap, uint64), 10, 1);
       i += 1;
     } else if(c0 == 'l' && c1 == 'l' && c2 == 'd'){
-      printint(va_arg(ap, uint64), 10, 1);
+      printint(&pb, va_arg(ap, uint64), 10, 1);
       i += 2;
     } else if(c0 == 'u'){
-      printint(va_arg(ap, int), 10, 0);
+      printint(&pb, va_arg(ap, int), 10, 0);
     } else if(c0 == 'l' && c1 == 'u'){
-      printint(va_arg(ap, uint64), 10, 0);
+      printint(&pb, va_arg(ap, uint64), 10, 0);
       i += 1;
     } else if(c0 == 'l' && c1 == 'l' && c2 == 'u'){
-      printint(va_arg(ap, uint64), 10, 0);
+      printint(&pb, va_arg(ap, uint64), 10, 0);
       i += 2;
     } else if(c0 == 'x'){
-      printint(va_arg(ap, int), 16, 0);
+      printint(&pb, va_arg(ap, int), 16, 0);
     } else if(c0 == 'l' && c1 == 'x'){
-      printint(va_arg(ap, uint64), 16, 0);
+      printint(&pb, va_arg(ap, uint64), 16, 0);
       i += 1;
     } else if(c0 == 'l' && c1 == 'l' && c2 == 'x'){
-      printint(va_arg(ap, uint64), 16, 0);
+      printint(&pb, va_arg(ap, uint64), 16, 0);
       i += 2;
     } else if(c0 == 'p'){
-      printptr(va_arg(ap, uint64));
+      printptr(&pb, va_arg(ap, uint64));
     } else if(c0 == 's'){
       if((s = va_arg(ap, char*)) == 0)
         s = "(null)";
       for(; *s; s++)
-        consputc(*s);
+        pputc(&pb, *s);
     } else if(c0 == '%'){
-      consputc('%');
+      pputc(&pb, '%');
     } else if(c0 == 0){
       break;
     } else {
       // Print unknown % sequence to draw attention.
-      consputc('%');
-      consputc(c0);
+      pputc(&pb, '%');
+      pputc(&pb, c0);
     }
 
 #if 0
@@ -152,9 +280,15 @@ printf(char *fmt, ...)
 #endif
   }
   va_end(ap);
+  pflush(&pb);
 
-  if(locking)
-    release(&pr.lock);
+  if(panicking){
+    klogsync();
+  } else {
+    // start the UART on the new output; its interrupts
+    // will send the rest.
+    uartkick();
+  }
 
   return 0;
 }
@@ -162,17 +296,10 @@ printf(char *fmt, ...)
 void
 panic(char *s)
 {
-  pr.locking = 0;
+  panicking = 1;
   printf("panic: ");
   printf("%s\n", s);
   panicked = 1; // freeze uart output from other CPUs
   for(;;)
     ;
 }
-
-void
-printfinit(void)
-{
-  initlock(&pr.lock, "pr");
-  pr.locking = 1;
-}
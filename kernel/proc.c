@@ -26,6 +26,21 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
+// ASIDs tag TLB entries with the page table they came from,
+// so that switching between the kernel and user page tables,
+// or between processes, needs no TLB flush. a process gets an
+// ASID when it first returns to user space. when the ASIDs run
+// out, a new generation starts: each process gets a fresh ASID
+// as it next runs, and each hart flushes its whole TLB once
+// when it first sees the new generation.
+int nasid;  // number of ASIDs the harts implement, from kvminithart()
+
+struct {
+  struct spinlock lock;
+  uint gen;
+  int next;
+} asids;
+
 // Allocate a page for each process's kernel stack.
 // Map it high in memory, followed by an invalid
 // guard page.
@@ -51,6 +66,9 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  initlock(&asids.lock, "asids");
+  asids.gen = 1;
+  asids.next = 1;
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
@@ -104,10 +122,10 @@ allocpid()
 
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// and return with p->lock held, ready to start at forkret.
+// If there are no free procs, return 0.
 static struct proc*
-allocproc(void)
+allocslot(void)
 {
   struct proc *p;
 
@@ -124,6 +142,31 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->asidgen = 0;
+  p->tlbstale = 0;
+  p->swappable = 0;
+  p->frozen = 0;
+  p->kmain = 0;
+
+  // Set up new context to start executing at forkret,
+  // which returns to user space.
+  memset(&p->context, 0, sizeof(p->context));
+  p->context.ra = (uint64)forkret;
+  p->context.sp = p->kstack + PGSIZE;
+
+  return p;
+}
+
+// Allocate a proc with a trapframe and an empty user
+// page table, and return with p->lock held.
+// If there are no free procs, or a memory allocation fails, return 0.
+static struct proc*
+allocproc(void)
+{
+  struct proc *p;
+
+  if((p = allocslot()) == 0)
+    return 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -140,15 +183,38 @@ found:
     return 0;
   }
 
-  // Set up new context to start executing at forkret,
-  // which returns to user space.
-  memset(&p->context, 0, sizeof(p->context));
-  p->context.ra = (uint64)forkret;
-  p->context.sp = p->kstack + PGSIZE;
-
   return p;
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadstart.
+static void
+kthreadstart(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kmain();
+  panic("kthread return");
+}
+
+// Start a kernel thread running fn, which never returns.
+// It has no user memory, and runs on the kernel page table.
+void
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocslot()) == 0)
+    panic("kthread");
+  p->kmain = fn;
+  p->context.ra = (uint64)kthreadstart;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // free a proc structure and the data hanging from it,
 // including user pages.
 // p->lock must be held.
@@ -162,6 +228,7 @@ freeproc(struct proc *p)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
+  p->rss = 0;
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
@@ -202,6 +269,16 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
+  // map the kernel too, so that the kernel can run on
+  // this page table while it works for the process.
+  if(kvmshare(pagetable) < 0){
+    kvmunshare(pagetable);
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+
   return pagetable;
 }
 
@@ -210,6 +287,7 @@ proc_pagetable(struct proc *p)
 void
 proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
+  kvmunshare(pagetable);
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
   uvmfree(pagetable, sz);
@@ -241,6 +319,7 @@ userinit(void)
   // and data into it.
   uvmfirst(p->pagetable, initcode, sizeof(initcode));
   p->sz = PGSIZE;
+  p->rss = 1;
 
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0;      // user program counter
@@ -267,10 +346,95 @@ growproc(int n)
     if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
       return -1;
     }
+    p->rss += (PGROUNDUP(sz) - PGROUNDUP(p->sz)) / PGSIZE;
   } else if(n < 0){
+    p->rss -= uvmrss(p->pagetable, sz + n, sz);
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
   p->sz = sz;
+  proctlbstale(p);
+  return 0;
+}
+
+// p's page table has changed, so every hart's TLB may hold
+// stale entries for p's ASID. each flushes them the next
+// time it runs p. an ASID is never reused within a generation,
+// so exit and exec, which abandon a page table, need no flush.
+void
+proctlbstale(struct proc *p)
+{
+  __sync_fetch_and_or(&p->tlbstale, ~0UL);
+  if(p == myproc()){
+    // the kernel is running on p's page table, and
+    // may touch user memory before returning to p.
+    push_off();
+    __sync_fetch_and_and(&p->tlbstale, ~(1UL << cpuid()));
+    if(nasid > 1)
+      sfence_vma_asid((r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK);
+    else
+      sfence_vma();
+    pop_off();
+  }
+}
+
+// the satp for p's page table, with p's ASID, allocating one
+// if need be and flushing any stale TLB entries for it on this
+// hart. called with interrupts off, before running p.
+uint64
+procsatp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 bit = 1UL << cpuid();
+  int flushall = 0;
+
+  if(p->pagetable == 0)
+    return MAKE_SATP(kernel_pagetable, 0);  // a kernel thread
+  if(nasid <= 1){
+    // no ASIDs; trampoline.S flushes the whole TLB.
+    return MAKE_SATP(p->pagetable, 0);
+  }
+
+  if(p->asidgen != asids.gen || c->asidgen != asids.gen){
+    acquire(&asids.lock);
+    if(p->asidgen != asids.gen){
+      if(asids.next >= nasid){
+        asids.gen++;
+        asids.next = 1;
+      }
+      p->asid = asids.next++;
+      p->asidgen = asids.gen;
+      // each hart fences the new ASID before its first use
+      // there, to order the page table's PTE stores, made on
+      // any hart, before the hardware's page walks.
+      p->tlbstale = ~0UL;
+    }
+    if(c->asidgen != asids.gen){
+      c->asidgen = asids.gen;
+      flushall = 1;
+    }
+    release(&asids.lock);
+  }
+
+  if(flushall){
+    __sync_fetch_and_and(&p->tlbstale, ~bit);
+    sfence_vma();
+  } else if(p->tlbstale & bit){
+    __sync_fetch_and_and(&p->tlbstale, ~bit);
+    sfence_vma_asid(p->asid);
+  }
+  return MAKE_SATP(p->pagetable, p->asid);
+}
+
+// is there a free proc? a hint, as the answer may
+// change as soon as it's given.
+static int
+anyunused(void)
+{
+  struct proc *p;
+
+  for(p = proc; p < &proc[NPROC]; p++)
+    if(p->state == UNUSED)
+      return 1;
   return 0;
 }
 
@@ -283,18 +447,30 @@ fork(void)
   struct proc *np;
   struct proc *p = myproc();
 
-  // Allocate process.
-  if((np = allocproc()) == 0){
-    return -1;
-  }
-
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
-    freeproc(np);
-    release(&np->lock);
-    return -1;
+  for(;;){
+    // Allocate process.
+    if((np = allocproc()) != 0){
+      // Copy user memory from parent to child. uvmcopy() may
+      // wait for memory to be swapped out, so can't be called
+      // holding a spinlock; np is USED, so nothing else will
+      // touch it meanwhile.
+      release(&np->lock);
+      if(uvmcopy(p->pagetable, np->pagetable, p->sz) == 0)
+        break;
+      acquire(&np->lock);
+      freeproc(np);
+      release(&np->lock);
+    } else if(!anyunused()){
+      return -1;
+    }
+    // out of memory: kill the largest process, and
+    // try again once it has exited.
+    if(!oomkill(1))
+      return -1;
   }
+  acquire(&np->lock);
   np->sz = p->sz;
+  np->rss = PGROUNDUP(p->sz) / PGSIZE;
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -351,6 +527,12 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // give back user memory now rather than when the parent
+  // waits, so that a killed process frees it promptly.
+  p->sz = uvmdealloc(p->pagetable, p->sz, 0);
+  p->rss = 0;
+  proctlbstale(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -394,6 +576,11 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the copyout() below holds locks, so can't wait
+  // for the page to be read in from swap.
+  if(addr != 0)
+    uvmfault(addr, sizeof(pp->xstate), 1);
+
   acquire(&wait_lock);
 
   for(;;){
@@ -457,13 +644,18 @@ scheduler(void)
     int found = 0;
     for(p = proc; p < &proc[NPROC]; p++) {
       acquire(&p->lock);
-      if(p->state == RUNNABLE) {
+      if(p->state == RUNNABLE && !p->frozen) {
         // Switch to chosen process.  It is the process's job
         // to release its lock and then reacquire it
         // before jumping back to us.
         p->state = RUNNING;
         c->proc = p;
+
+        // the kernel runs on the process's page table,
+        // which maps the kernel as well as user memory.
+        kvmswitch(procsatp(p));
         swtch(&c->context, &p->context);
+        kvmswitch(MAKE_SATP(kernel_pagetable, 0));
 
         // Process is done running for now.
         // It should have changed its p->state before coming back.
@@ -472,8 +664,9 @@ scheduler(void)
       }
       release(&p->lock);
     }
-    if(found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
+    if(found == 0 && !kzeroidle()) {
+      // nothing to run, and no pages to zero; stop running
+      // on this core until an interrupt.
       intr_on();
       asm volatile("wfi");
     }
@@ -533,6 +726,7 @@ forkret(void)
     // regular process (e.g., because it calls sleep), and thus cannot
     // be run from main().
     fsinit(ROOTDEV);
+    swapdiskinit();
 
     first = 0;
     // ensure other cores see first=0.
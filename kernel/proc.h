@@ -24,6 +24,7 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint asidgen;               // ASID generation this TLB has been flushed for
 };
 
 extern struct cpu cpus[NCPU];
@@ -40,6 +41,9 @@ extern struct cpu cpus[NCPU];
 // the trapframe includes callee-saved user registers like s0-s11 because the
 // return-to-user path via usertrapret() doesn't return through
 // the entire kernel call stack.
+// system calls in SYSFAST take a shorter path: uservec saves only
+// the registers a C function may clobber, calls kernel_fast, and
+// returns straight to user space, leaving s0-s11 unsaved.
 struct trapframe {
   /*   0 */ uint64 kernel_satp;   // kernel page table
   /*   8 */ uint64 kernel_sp;     // top of process's kernel stack
@@ -77,6 +81,8 @@ struct trapframe {
   /* 264 */ uint64 t4;
   /* 272 */ uint64 t5;
   /* 280 */ uint64 t6;
+  /* 288 */ uint64 kernel_fast;   // usertrapfast()
+  /* 296 */ uint64 sysfast;       // SYSFAST, or 0 for no fast path
 };
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
@@ -91,6 +97,7 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int frozen;                  // swap.c or ksm.c is changing the page table; don't run
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
@@ -98,9 +105,15 @@ struct proc {
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  int rss;                     // Resident user pages; swap.c changes it while p is frozen
+  pagetable_t pagetable;       // User page table, or 0 for a kernel thread
+  int asid;                    // ASID for pagetable, if asidgen is current
+  uint asidgen;                // ASID generation, or 0 for none yet
+  uint64 tlbstale;             // Harts that must flush asid before running p
+  int swappable;               // Pages may be swapped out while p waits
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
+  void (*kmain)(void);         // a kernel thread's function
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
@@ -46,6 +46,7 @@ w_mepc(uint64 x)
 #define SSTATUS_SPIE (1L << 5) // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
 #define SSTATUS_SIE (1L << 1)  // Supervisor Interrupt Enable
+#define SSTATUS_SUM (1L << 18) // Supervisor may access User Memory
 #define SSTATUS_UIE (1L << 0)  // User Interrupt Enable
 
 static inline uint64
@@ -224,7 +225,13 @@ w_pmpaddr0(uint64 x)
 // use riscv's sv39 page table scheme.
 #define SATP_SV39 (8L << 60)
 
-#define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
+// an address space identifier (ASID) tags the TLB entries
+// made through a page table. the kernel uses ASID 0.
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK 0xffffL
+
+#define MAKE_SATP(pagetable, asid) \
+  (SATP_SV39 | ((uint64)(asid) << SATP_ASID_SHIFT) | (((uint64)pagetable) >> 12))
 
 // supervisor address translation and protection;
 // holds the address of the page table.
@@ -275,6 +282,13 @@ r_mcounteren()
   return x;
 }
 
+// Supervisor-mode Counter-Enable
+static inline void 
+w_scounteren(uint64 x)
+{
+  asm volatile("csrw scounteren, %0" : : "r" (x));
+}
+
 // machine-mode cycle counter
 static inline uint64
 r_time()
@@ -354,6 +368,13 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries for one address space.
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
 typedef uint64 pte_t;
 typedef uint64 *pagetable_t; // 512 PTEs
 
@@ -375,6 +396,14 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_A (1L << 6) // accessed
+#define PTE_D (1L << 7) // dirty
+#define PTE_SWAP (1L << 8) // with PTE_V clear: page is on swap (RSW bit)
+// PTE_ZRAM and PTE_COW are the same RSW bit: PTE_V says which.
+// a swapped-out page is never valid, and a shared one always is.
+#define PTE_ZRAM (1L << 9) // with PTE_SWAP: in zram, not on the disk
+#define PTE_COW (1L << 9)  // with PTE_V: shared by ksm.c; copy on write
+#define PTE_SHARED (1L << 8) // with PTE_V: a shm.c segment; fork shares it
 
 
 
@@ -389,6 +418,11 @@ typedef uint64 *pagetable_t; // 512 PTEs
 
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
+// a swapped-out page's PTE keeps its slot number where
+// the PPN would be, and its R/W/X/U permissions.
+#define SWAPPTE(slot, pte) ((((uint64)(slot)) << 10) | PTE_SWAP | ((pte) & 0x1E))
+#define PTE2SLOT(pte) ((pte) >> 10)
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK          0x1FF // 9 bits
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
@@ -0,0 +1,200 @@
+//
+// named shared memory segments, and futexes to wait on
+// words in them.
+//
+// shmmap(name, sz) creates the segment name, if there isn't
+// one, and maps it at the top of the process's memory. its
+// PTEs have PTE_SHARED set, so fork() shares the pages rather
+// than copying them, and swap.c and ksm.c leave them alone.
+// the segment table holds a reference to each page (see
+// kdup()), and so does each mapping: shmunlink() drops the
+// table's, and exit(), exec() and sbrk() the mappings', so
+// the pages are freed once the name is gone and no process
+// maps them.
+//
+// a futex is a word of user memory that processes can sleep
+// on until another changes it. sleepers are keyed by the
+// word's physical address, which is the same in every
+// process that maps a segment.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+
+struct seg {
+  char name[SHMNAME];   // empty if the slot is free
+  int npage;
+  char *pages[SHMMAXPG];
+};
+
+struct {
+  struct sleeplock lock;  // kalloc() may wait for swap
+  struct seg seg[NSHM];
+} shm;
+
+struct spinlock futexlock;
+
+void
+shminit(void)
+{
+  initsleeplock(&shm.lock, "shm");
+  initlock(&futexlock, "futex");
+}
+
+static struct seg *
+lookup(char *name)
+{
+  struct seg *s;
+
+  for(s = shm.seg; s < &shm.seg[NSHM]; s++)
+    if(s->name[0] && strncmp(s->name, name, SHMNAME) == 0)
+      return s;
+  return 0;
+}
+
+// make a segment of npage zeroed pages.
+// returns it, or 0 if out of slots or memory.
+static struct seg *
+create(char *name, int npage)
+{
+  struct seg *s;
+  int i;
+
+  for(s = shm.seg; s < &shm.seg[NSHM]; s++)
+    if(s->name[0] == 0)
+      break;
+  if(s == &shm.seg[NSHM])
+    return 0;
+  for(i = 0; i < npage; i++){
+    if((s->pages[i] = kalloc_zeroed()) == 0){
+      while(--i >= 0)
+        kfree(s->pages[i]);
+      return 0;
+    }
+  }
+  s->npage = npage;
+  safestrcpy(s->name, name, SHMNAME);
+  return s;
+}
+
+// map segment name, of at least sz bytes, into the current
+// process, creating it if need be. returns its address,
+// or -1.
+uint64
+shmmap(char *name, int sz)
+{
+  struct proc *p = myproc();
+  struct seg *s;
+  uint64 va;
+  int i, npage;
+
+  npage = PGROUNDUP((uint64)sz) / PGSIZE;
+  if(name[0] == 0 || sz <= 0 || npage > SHMMAXPG)
+    return -1;
+  va = PGROUNDUP(p->sz);
+  if(va + (uint64)npage * PGSIZE > MAXUVA)
+    return -1;
+
+  acquiresleep(&shm.lock);
+  if((s = lookup(name)) == 0 && (s = create(name, npage)) == 0)
+    goto bad;
+  if(npage > s->npage)
+    goto bad;
+  for(i = 0; i < s->npage; i++){
+    kdup(s->pages[i]);
+    if(mappages(p->pagetable, va + i*PGSIZE, PGSIZE, (uint64)s->pages[i],
+                PTE_R|PTE_W|PTE_U|PTE_SHARED) != 0){
+      kfree(s->pages[i]);
+      uvmunmap(p->pagetable, va, i, 1);
+      goto bad;
+    }
+  }
+  releasesleep(&shm.lock);
+
+  p->sz = va + s->npage*PGSIZE;
+  p->rss += s->npage;
+  proctlbstale(p);
+  return va;
+
+ bad:
+  releasesleep(&shm.lock);
+  return -1;
+}
+
+// remove segment name. its pages are freed when
+// no process maps them. returns 0, or -1.
+int
+shmunlink(char *name)
+{
+  struct seg *s;
+  int i;
+
+  acquiresleep(&shm.lock);
+  if((s = lookup(name)) == 0){
+    releasesleep(&shm.lock);
+    return -1;
+  }
+  for(i = 0; i < s->npage; i++)
+    kfree(s->pages[i]);
+  s->name[0] = 0;
+  releasesleep(&shm.lock);
+  return 0;
+}
+
+// the physical address of the current process's word at
+// addr, with futexlock held, or 0.
+static uint64
+futexaddr(uint64 addr)
+{
+  struct proc *p = myproc();
+  uint64 pa;
+
+  if(addr % sizeof(int) != 0 || addr >= p->sz)
+    return 0;
+  for(;;){
+    acquire(&futexlock);
+    if((pa = walkaddr(p->pagetable, addr)) != 0)
+      return pa + addr % PGSIZE;
+    release(&futexlock);
+    // the page may be out on swap.
+    if(killed(p) || uvmfault(addr, sizeof(int), 0) <= 0)
+      return 0;
+  }
+}
+
+// sleep until futexwake(addr), if the word at
+// addr holds val. returns 0, or -1.
+int
+futexwait(uint64 addr, int val)
+{
+  uint64 pa;
+
+  if((pa = futexaddr(addr)) == 0)
+    return -1;
+  // a waker changes the word before it takes futexlock,
+  // so a change can't be missed between here and sleep().
+  if(*(volatile int *)pa == val && !killed(myproc()))
+    sleep((void *)pa, &futexlock);
+  release(&futexlock);
+  return 0;
+}
+
+// wake every process waiting on the word at addr.
+// returns 0, or -1.
+int
+futexwake(uint64 addr)
+{
+  uint64 pa;
+
+  if((pa = futexaddr(addr)) == 0)
+    return -1;
+  wakeup((void *)pa);
+  release(&futexlock);
+  return 0;
+}
@@ -0,0 +1,265 @@
+//
+// caches of fixed-size kernel objects: pipes, files,
+// inodes and buffers.
+//
+// a cache carves kalloc()'d pages, called slabs, into
+// objects of its size. a slab page starts with a struct
+// slab, and its free objects are linked through their
+// first word; slabs with free objects are on the cache's
+// partial list, and a slab whose objects are all free
+// goes back to kalloc(). an object being freed goes first
+// into a magazine on the freeing CPU, and the next
+// allocation on that CPU takes it from there, so most
+// allocations and frees touch only that CPU's magazine.
+// when kalloc() runs short it calls slabreclaim() to
+// empty the magazines and give back the slabs that frees.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "slab.h"
+#include "defs.h"
+
+struct slab {
+  struct slab *next;       // in the partial list
+  struct slab *prev;
+  struct slabcache *c;
+  int nfree;
+  void *free;              // free objects
+};
+
+#define SLABHDR ((sizeof(struct slab) + 7) & ~7)
+
+static struct spinlock cacheslock;
+static struct slabcache *caches;
+
+// set up cache c, of objects of size bytes.
+void
+slabinit(struct slabcache *c, char *name, int size)
+{
+  int i;
+
+  size = (size + 7) & ~7;
+  if(size < sizeof(void *) || size > PGSIZE - SLABHDR)
+    panic("slabinit");
+  c->name = name;
+  c->size = size;
+  c->nper = (PGSIZE - SLABHDR) / size;
+  initlock(&c->lock, name);
+  for(i = 0; i < NCPU; i++)
+    initlock(&c->mag[i].lock, "magazine");
+
+  if(cacheslock.name == 0)
+    initlock(&cacheslock, "slabcaches");
+  acquire(&cacheslock);
+  c->link = caches;
+  caches = c;
+  release(&cacheslock);
+}
+
+static void
+addpartial(struct slabcache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+static void
+delpartial(struct slabcache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// take an object from c's slabs. c->lock must be held.
+// returns 0 if there are no free objects.
+static void *
+getobj(struct slabcache *c)
+{
+  struct slab *s;
+  void *o;
+
+  if((s = c->partial) == 0)
+    return 0;
+  o = s->free;
+  s->free = *(void **)o;
+  if(--s->nfree == 0)
+    delpartial(c, s);
+  return o;
+}
+
+// give an object back to its slab. c->lock must be held.
+// returns the slab's page if it is now free, for the
+// caller to kfree() once it has let go of the lock.
+static void *
+putobj(struct slabcache *c, void *o)
+{
+  struct slab *s = (struct slab *)PGROUNDDOWN((uint64)o);
+
+  if(s->c != c)
+    panic("slabfree: wrong cache");
+  *(void **)o = s->free;
+  s->free = o;
+  if(s->nfree++ == 0)
+    addpartial(c, s);
+  if(s->nfree < c->nper)
+    return 0;
+  delpartial(c, s);
+  c->nslab--;
+  return s;
+}
+
+// make a new slab for c, and add it to the partial list.
+// returns 0 if out of memory.
+static int
+grow(struct slabcache *c)
+{
+  struct slab *s;
+  char *o;
+  int i;
+
+  if((s = kalloc()) == 0)
+    return 0;
+  s->c = c;
+  s->free = 0;
+  for(i = c->nper - 1; i >= 0; i--){
+    o = (char *)s + SLABHDR + i * c->size;
+    *(void **)o = s->free;
+    s->free = o;
+  }
+  s->nfree = c->nper;
+  acquire(&c->lock);
+  addpartial(c, s);
+  c->nslab++;
+  release(&c->lock);
+  return 1;
+}
+
+// allocate an object from c. its contents are what the
+// last user left. returns 0 if out of memory.
+void *
+slaballoc(struct slabcache *c)
+{
+  void *o;
+  int id;
+
+  push_off();
+  id = cpuid();
+  acquire(&c->mag[id].lock);
+  o = c->mag[id].n > 0 ? c->mag[id].obj[--c->mag[id].n] : 0;
+  release(&c->mag[id].lock);
+  pop_off();
+
+  // no lock is held here, so grow()'s kalloc()
+  // can call slabreclaim().
+  while(o == 0){
+    acquire(&c->lock);
+    o = getobj(c);
+    release(&c->lock);
+    if(o == 0 && grow(c) == 0)
+      return 0;
+  }
+  __sync_fetch_and_add(&c->nalloc, 1);
+  return o;
+}
+
+// give n objects from CPU id's magazine back to their
+// slabs. the caller holds the magazine's lock. returns
+// a list, linked through their first words, of the slab
+// pages that are now free.
+static void *
+flush(struct slabcache *c, int id, int n)
+{
+  void *pg, *list;
+
+  list = 0;
+  acquire(&c->lock);
+  while(n-- > 0 && c->mag[id].n > 0){
+    if((pg = putobj(c, c->mag[id].obj[--c->mag[id].n])) != 0){
+      *(void **)pg = list;
+      list = pg;
+    }
+  }
+  release(&c->lock);
+  return list;
+}
+
+// kfree() a list from flush(), once the cache's locks
+// are released.
+static void
+freelist(void *list)
+{
+  void *pg;
+
+  while((pg = list) != 0){
+    list = *(void **)pg;
+    kfree(pg);
+  }
+}
+
+// free object o, which came from slaballoc(c).
+void
+slabfree(struct slabcache *c, void *o)
+{
+  void *pg = 0;
+  int id;
+
+  __sync_fetch_and_sub(&c->nalloc, 1);
+  push_off();
+  id = cpuid();
+  acquire(&c->mag[id].lock);
+  if(c->mag[id].n == MAGSIZE)
+    pg = flush(c, id, MAGSIZE / 2);
+  c->mag[id].obj[c->mag[id].n++] = o;
+  release(&c->mag[id].lock);
+  pop_off();
+  freelist(pg);
+}
+
+// empty every magazine, so that slabs whose objects are
+// all free go back to kalloc(). called when memory is
+// short; the caller must not hold a cache's locks.
+void
+slabreclaim(void)
+{
+  struct slabcache *c;
+  void *pg;
+  int id;
+
+  acquire(&cacheslock);
+  for(c = caches; c; c = c->link){
+    for(id = 0; id < NCPU; id++){
+      acquire(&c->mag[id].lock);
+      pg = flush(c, id, MAGSIZE);
+      release(&c->mag[id].lock);
+      freelist(pg);
+    }
+  }
+  release(&cacheslock);
+}
+
+// describe the caches, for the statistics device.
+int
+slabstats(char *buf, int sz)
+{
+  struct slabcache *c;
+  int n;
+
+  n = 0;
+  acquire(&cacheslock);
+  for(c = caches; c; c = c->link)
+    n += snprintf(buf + n, sz - n, "slab %s: %d objects of %d bytes in use, %d slabs of %d\n",
+                  c->name, c->nalloc, c->size, c->nslab, c->nper);
+  release(&cacheslock);
+  return n;
+}
@@ -0,0 +1,18 @@
+#define MAGSIZE 16  // objects in a CPU's magazine
+
+// a cache of kernel objects of one size; see slab.c.
+struct slabcache {
+  char *name;
+  int size;                // object size, rounded up
+  int nper;                // objects per slab
+  struct spinlock lock;    // protects the slabs and counts
+  struct slab *partial;    // slabs with free objects
+  int nslab;
+  int nalloc;              // objects handed out
+  struct {
+    struct spinlock lock;
+    int n;
+    void *obj[MAGSIZE];    // objects freed on this CPU
+  } mag[NCPU];
+  struct slabcache *link;  // next cache, for slabreclaim()
+};
@@ -0,0 +1,108 @@
+//
+// formatted output to a string: snprintf(), for the
+// statistics device.
+//
+
+#include <stdarg.h>
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+static char digits[] = "0123456789abcdef";
+
+struct sbuf {
+  char *buf;
+  int sz;   // room in buf, not counting the terminating 0
+  int n;    // characters written
+};
+
+static void
+sputc(struct sbuf *sb, char c)
+{
+  if(sb->n < sb->sz)
+    sb->buf[sb->n++] = c;
+}
+
+static void
+sprintint(struct sbuf *sb, long long xx, int base, int sign)
+{
+  char buf[20];
+  int i;
+  unsigned long long x;
+
+  if(sign && (sign = (xx < 0)))
+    x = -xx;
+  else
+    x = xx;
+
+  i = 0;
+  do {
+    buf[i++] = digits[x % base];
+  } while((x /= base) != 0);
+
+  if(sign)
+    buf[i++] = '-';
+
+  while(--i >= 0)
+    sputc(sb, buf[i]);
+}
+
+// print to buf, which has room for sz bytes. the output
+// is always terminated with a 0, and cut short if need be.
+// returns the number of characters in buf.
+int
+snprintf(char *buf, int sz, char *fmt, ...)
+{
+  va_list ap;
+  int i, c, c1;
+  char *s;
+  struct sbuf sb;
+
+  if(sz <= 0)
+    return 0;
+  sb.buf = buf;
+  sb.sz = sz - 1;
+  sb.n = 0;
+  va_start(ap, fmt);
+  for(i = 0; (c = fmt[i] & 0xff) != 0; i++){
+    if(c != '%'){
+      sputc(&sb, c);
+      continue;
+    }
+    c = fmt[++i] & 0xff;
+    c1 = c ? fmt[i+1] & 0xff : 0;
+    if(c == 'd'){
+      sprintint(&sb, va_arg(ap, int), 10, 1);
+    } else if(c == 'l' && c1 == 'd'){
+      sprintint(&sb, va_arg(ap, uint64), 10, 1);
+      i++;
+    } else if(c == 'x'){
+      sprintint(&sb, va_arg(ap, int), 16, 0);
+    } else if(c == 'l' && c1 == 'x'){
+      sprintint(&sb, va_arg(ap, uint64), 16, 0);
+      i++;
+    } else if(c == 's'){
+      if((s = va_arg(ap, char*)) == 0)
+        s = "(null)";
+      for(; *s; s++)
+        sputc(&sb, *s);
+    } else if(c == '%'){
+      sputc(&sb, '%');
+    } else if(c == 0){
+      break;
+    } else {
+      // Print unknown % sequence to draw attention.
+      sputc(&sb, '%');
+      sputc(&sb, c);
+    }
+  }
+  va_end(ap);
+  buf[sb.n] = '\0';
+  return sb.n;
+}
@@ -60,6 +60,10 @@ timerinit()
   
   // allow supervisor to use stimecmp and time.
   w_mcounteren(r_mcounteren() | 2);
+
+  // allow user code to read the cycle counter, for benchmarks.
+  w_mcounteren(r_mcounteren() | 1);
+  w_scounteren(1);
   
   // ask for the very first timer interrupt.
   w_stimecmp(r_time() + 1000000);
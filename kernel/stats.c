@@ -0,0 +1,133 @@
+//
+// the statistics device: reading it returns a report
+// from each part of the kernel that keeps statistics.
+// a file's first read makes a snapshot of the report, and
+// it and the reads that follow return the snapshot's parts
+// in turn, so that a reader whose buffer is smaller than the
+// report still sees a whole, consistent one, and readers of
+// different files don't disturb each other. the file's
+// offset says which snapshot it reads, and where. once a
+// file reaches the end, its next read makes a new snapshot.
+// writing "ksm 1" or "ksm 0" to it turns page merging
+// on or off, and "sysfast 1" or "sysfast 0" the fast
+// system call path.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define BUFSZ 4096
+#define NSNAP 4          // snapshots being read at once
+#define POSBITS 13       // of a file's offset, for the position
+
+struct snap {
+  uint gen;              // which snapshot; 0 if none
+  int sz;
+  char buf[BUFSZ];
+};
+
+static struct {
+  struct sleeplock lock;  // copyout() may wait for swap
+  struct snap snap[NSNAP];
+  int next;               // the oldest snapshot
+  uint gen;               // of the last snapshot made
+} stats;
+
+// make a snapshot of the report, in place of the oldest.
+static struct snap *
+snapshot(void)
+{
+  struct snap *sn;
+
+  sn = &stats.snap[stats.next];
+  stats.next = (stats.next + 1) % NSNAP;
+  sn->sz = kallocstats(sn->buf, BUFSZ);
+  sn->sz += slabstats(sn->buf + sn->sz, BUFSZ - sn->sz);
+  sn->sz += swapstats(sn->buf + sn->sz, BUFSZ - sn->sz);
+  sn->sz += ksmstats(sn->buf + sn->sz, BUFSZ - sn->sz);
+  sn->sz += oomstats(sn->buf + sn->sz, BUFSZ - sn->sz);
+  sn->sz += diskstats(sn->buf + sn->sz, BUFSZ - sn->sz);
+  // the generation must fit in a file's offset.
+  if(++stats.gen >= 1 << (32 - POSBITS))
+    stats.gen = 1;
+  sn->gen = stats.gen;
+  return sn;
+}
+
+int
+statswrite(int user_src, uint64 src, int n)
+{
+  char buf[16];
+
+  if(n >= sizeof(buf) || either_copyin(buf, user_src, src, n) == -1)
+    return -1;
+  buf[n] = '\0';
+  if(n > 0 && buf[n-1] == '\n')
+    buf[n-1] = '\0';
+  if(strncmp(buf, "ksm ", 4) == 0 && (buf[4] == '0' || buf[4] == '1') && buf[5] == '\0')
+    return ksmrun(buf[4] == '1') < 0 ? -1 : n;
+  if(strncmp(buf, "sysfast ", 8) == 0 && (buf[8] == '0' || buf[8] == '1') && buf[9] == '\0'){
+    sysfast = buf[8] == '1';
+    return n;
+  }
+  return -1;
+}
+
+// read from the file's snapshot. *off holds the snapshot's
+// generation above POSBITS, and the position below, or is 0
+// for a new snapshot. fails if NSNAP newer snapshots have
+// taken the file's place.
+int
+statsread(int user_dst, uint64 dst, uint *off, int n)
+{
+  struct snap *sn, *s;
+  uint gen, pos;
+  int m;
+
+  acquiresleep(&stats.lock);
+  sn = 0;
+  if(*off == 0){
+    sn = snapshot();
+    pos = 0;
+  } else {
+    gen = *off >> POSBITS;
+    pos = *off & ((1 << POSBITS) - 1);
+    for(s = stats.snap; s < &stats.snap[NSNAP]; s++)
+      if(s->gen == gen)
+        sn = s;
+    if(sn == 0){
+      releasesleep(&stats.lock);
+      return -1;
+    }
+  }
+  m = sn->sz - (int)pos;
+  if(m > n)
+    m = n;
+  if(m > 0){
+    if(either_copyout(user_dst, dst, sn->buf + pos, m) == -1)
+      m = -1;
+    else
+      *off = sn->gen << POSBITS | (pos + m);
+  } else {
+    // end of the report; the next read makes a new one.
+    m = 0;
+    *off = 0;
+  }
+  releasesleep(&stats.lock);
+  return m;
+}
+
+void
+statsinit(void)
+{
+  initsleeplock(&stats.lock, "stats");
+
+  devsw[STATS].readat = statsread;
+  devsw[STATS].write = statswrite;
+}
@@ -0,0 +1,442 @@
+//
+// Paging of user memory to a swap area on the disk.
+//
+// when kalloc() runs out of memory, swapreclaim() takes
+// pages from processes, the caller's own among them, chosen
+// by a clock (second chance) scan over their page tables: a
+// page whose PTE_A bit is set has the bit cleared and is
+// passed over; one without it is evicted. evicted pages go first to zram.c's
+// compressed pool in memory; those that don't compress well,
+// or don't fit, are written to a swap area that mkfs
+// reserves after the file system. the page's PTE is replaced
+// by one with PTE_V clear and PTE_SWAP set, which holds the
+// zram entry or the disk slot (see SWAPPTE in riscv.h). the
+// next fault on the page reads it back in, with swapin().
+//
+// a process's pages are only taken while it waits at a
+// point where the kernel holds no pointers into its
+// memory: p->swappable is set around those waits, and
+// p->frozen keeps the scheduler from running p while
+// its page table is being changed. kalloc() is such a
+// point too, so a process short of memory may page out
+// its own.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "virtio.h"
+#include "defs.h"
+
+#define SLOTBLOCKS (PGSIZE / BSIZE)      // disk blocks per page
+#define NSLOT      (SWAPBLOCKS / SLOTBLOCKS)
+#define SWAPBATCH  (NUM - 2)             // pages per disk request
+#define SWAPWAIT   3                     // ticks to wait for a victim
+#define TIMEUS     10                    // time CSR ticks per microsecond
+
+extern struct proc proc[NPROC];
+extern struct superblock sb;
+
+struct {
+  struct spinlock lock;      // protects used[] and next
+  uint start;                // first block of the swap area
+  int nslot;                 // 0 if there is no swap area
+  uchar used[NSLOT / 8];     // one bit per slot
+  int next;                  // where to look for free slots
+
+  struct sleeplock reclaim;  // one process pages out at a time
+  int hand;                  // clock hand: a process in proc[]
+  uint64 handva;             // and a virtual address in it
+
+  // statistics, for the stats device.
+  int ndisk;                 // pages on disk
+  int nfault[2];             // faults from zram, disk
+  uint64 faulttime[2];       // and the time they took
+} swap;
+
+void
+swapinit(void)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.reclaim, "swapreclaim");
+  zraminit();
+}
+
+// find the disk swap area, once there is a file system.
+void
+swapdiskinit(void)
+{
+  swap.start = sb.swapstart;
+  __sync_synchronize();
+  swap.nslot = (sb.nswap < SWAPBLOCKS ? sb.nswap : SWAPBLOCKS) / SLOTBLOCKS;
+}
+
+static int
+slotused(int s)
+{
+  return swap.used[s / 8] & (1 << (s % 8));
+}
+
+// allocate n consecutive slots, so that n pages can be
+// written with one request. returns the first, or -1.
+static int
+slotalloc(int n)
+{
+  int i, j, s;
+
+  acquire(&swap.lock);
+  for(i = 0, s = swap.next; i < swap.nslot; i++, s = (s + 1) % swap.nslot){
+    if(s + n > swap.nslot)
+      continue;
+    for(j = 0; j < n && !slotused(s + j); j++)
+      ;
+    if(j == n){
+      for(j = 0; j < n; j++)
+        swap.used[(s + j) / 8] |= 1 << ((s + j) % 8);
+      swap.ndisk += n;
+      swap.next = (s + n) % swap.nslot;
+      release(&swap.lock);
+      return s;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+static void
+slotfree(uint slot)
+{
+  if(slot >= swap.nslot)
+    panic("slotfree");
+  acquire(&swap.lock);
+  if(!slotused(slot))
+    panic("slotfree: free");
+  swap.used[slot / 8] &= ~(1 << (slot % 8));
+  swap.ndisk--;
+  release(&swap.lock);
+}
+
+// free the space a swapped-out page's PTE refers to.
+void
+swapfree(pte_t pte)
+{
+  if(pte & PTE_ZRAM)
+    zramfree(PTE2SLOT(pte));
+  else
+    slotfree(PTE2SLOT(pte));
+}
+
+// can the caller sleep waiting for the disk? not if it
+// holds a spinlock or otherwise has interrupts off.
+int
+canwait(void)
+{
+  struct cpu *c;
+  int ok;
+
+  push_off();
+  c = mycpu();
+  ok = c->noff == 1 && c->intena && c->proc != 0;
+  pop_off();
+  return ok;
+}
+
+// page out up to SWAPBATCH of q's pages, going on with
+// the clock scan from swap.handva. the caller has set
+// q->frozen, or is q. returns the number of pages evicted.
+static int
+evict(struct proc *q)
+{
+  pte_t *ptes[SWAPBATCH], *pte;
+  char *pages[SWAPBATCH], *pa;
+  uint64 va;
+  int i, n, nz, e, slot, aged;
+
+  n = 0;
+  nz = 0;
+  aged = 0;
+  for(va = swap.handva; va < q->sz && n + nz < SWAPBATCH; va += PGSIZE){
+    pte = walk(q->pagetable, va, 0);
+    if(pte == 0 || (*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+      continue;
+    if(*pte & PTE_A){
+      // used since the hand last passed: a second chance.
+      *pte &= ~PTE_A;
+      aged = 1;
+      continue;
+    }
+    // pages that ksm.c or shm.c share stay in memory. take
+    // one that only q uses out of ksm.c's table, so it
+    // stays that way.
+    pa = (char *)PTE2PA(*pte);
+    if(*pte & (PTE_COW|PTE_SHARED))
+      continue;
+    if(kref(pa) == 1)
+      ksmforget(pa);
+    if(kref(pa) > 1)
+      continue;
+    if((e = zramstore(pa)) >= 0){
+      *pte = SWAPPTE(e, *pte) | PTE_ZRAM;
+      nz++;
+      continue;
+    }
+    // doesn't compress: to the disk.
+    ptes[n] = pte;
+    pages[n] = pa;
+    n++;
+  }
+  swap.handva = va;
+  q->rss -= nz;
+  if(aged || nz)
+    proctlbstale(q);  // forget old PTEs, and set PTE_A again
+
+  slot = -1;
+  while(n > 0 && (slot = slotalloc(n)) < 0)
+    n--;
+  if(n == 0)
+    return nz;
+
+  virtio_disk_rwpages(swap.start + slot * SLOTBLOCKS, pages, n, 1);
+
+  for(i = 0; i < n; i++)
+    *ptes[i] = SWAPPTE(slot + i, *ptes[i]);
+  q->rss -= n;
+  proctlbstale(q);
+  for(i = 0; i < n; i++)
+    kfree(pages[i]);
+  return nz + n;
+}
+
+// move the clock hand on until some pages have been
+// paged out, or it has been twice round every process.
+static int
+swapout(void)
+{
+  struct proc *q;
+  int i, n;
+
+  for(i = 0; i < 2 * NPROC; i++){
+    q = &proc[swap.hand];
+    n = 0;
+    if(q == myproc()){
+      // the caller's own pages. it is in kalloc(), at a
+      // point where it would let others take them while it
+      // waited; and since it is running here, it needn't be
+      // frozen.
+      if(q->pagetable != 0){
+        n = evict(q);
+        if(n > 0 && swap.handva < q->sz)
+          return n;
+      }
+    } else {
+      acquire(&q->lock);
+      if((q->state == RUNNABLE || q->state == SLEEPING) &&
+         q->swappable && !q->frozen && q->pagetable != 0){
+        q->frozen = 1;
+        release(&q->lock);
+        n = evict(q);
+        acquire(&q->lock);
+        q->frozen = 0;
+        if(n > 0 && swap.handva < q->sz){
+          release(&q->lock);
+          return n;  // come back to q next time
+        }
+      }
+      release(&q->lock);
+    }
+    swap.hand = (swap.hand + 1) % NPROC;
+    swap.handva = 0;
+    if(n > 0)
+      return n;
+  }
+  return 0;
+}
+
+// called by kalloc() when memory runs out. pages out
+// some process's memory, perhaps the caller's, and returns
+// 1, or returns 0 if that isn't possible.
+int
+swapreclaim(void)
+{
+  struct proc *p = myproc();
+  uint ticks0;
+  int n;
+
+  if(!canwait())
+    return 0;
+
+  acquire(&tickslock);
+  ticks0 = ticks;
+  release(&tickslock);
+  for(;;){
+    acquiresleep(&swap.reclaim);
+    n = swapout();
+    releasesleep(&swap.reclaim);
+    if(n > 0)
+      return 1;
+    if(killed(p))
+      return 0;
+
+    // every other process is busy in the kernel, and this
+    // one has nothing to page out. wait a tick for some to
+    // get back to where their pages can be taken, and let
+    // others take this process's pages meanwhile.
+    acquire(&tickslock);
+    if(ticks - ticks0 >= SWAPWAIT){
+      release(&tickslock);
+      return 0;
+    }
+    p->swappable = 1;
+    sleep(&ticks, &tickslock);
+    p->swappable = 0;
+    release(&tickslock);
+  }
+}
+
+// decompress p's page at va from zram. returns 1,
+// or -1 if out of memory.
+static int
+zramin(struct proc *p, pte_t *pte)
+{
+  char *mem;
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  zramload(PTE2SLOT(*pte), mem);
+  zramfree(PTE2SLOT(*pte));
+  *pte = PA2PTE(mem) | (*pte & (PTE_R|PTE_W|PTE_X|PTE_U)) | PTE_V | PTE_A;
+  proctlbstale(p);
+  return 1;
+}
+
+// read in p's swapped-out page at va, and those written
+// out along with it that follow it. returns the number
+// of pages read, or -1 if out of memory.
+static int
+readin(struct proc *p, uint64 va)
+{
+  pte_t *ptes[SWAPBATCH], *pte;
+  char *pages[SWAPBATCH], *blk;
+  uint slot = 0;
+  uint64 t0;
+  int i, k, n, o, z;
+
+  pte = walk(p->pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_SWAP)) != PTE_SWAP)
+    return 0;
+  t0 = r_time();
+  z = (*pte & PTE_ZRAM) != 0;
+  if(z){
+    n = zramin(p, pte);
+    goto out;
+  }
+
+  for(n = 0; n < SWAPBATCH && va + n*PGSIZE < p->sz; n++){
+    pte = walk(p->pagetable, va + n*PGSIZE, 0);
+    if(pte == 0 || (*pte & (PTE_V|PTE_SWAP|PTE_ZRAM)) != PTE_SWAP)
+      break;
+    if(n == 0)
+      slot = PTE2SLOT(*pte);
+    else if(PTE2SLOT(*pte) != slot + n)
+      break;
+    ptes[n] = pte;
+  }
+  if(n == 0)
+    return 0;
+
+  // read into one block of contiguous pages, if there is
+  // one, so that the disk gets a single buffer. the pages
+  // beyond n go back at once, as the largest blocks that fit.
+  for(o = 0; (1 << o) < n; o++)
+    ;
+  if(n > 1 && (blk = kalloc_order(o)) != 0){
+    for(i = 0; i < n; i++)
+      pages[i] = blk + i*PGSIZE;
+    while(i < (1 << o)){
+      for(k = 0; (i & (1 << k)) == 0 && i + (2 << k) <= (1 << o); k++)
+        ;
+      kfree_order(blk + i*PGSIZE, k);
+      i += 1 << k;
+    }
+  } else {
+    blk = 0;
+    for(i = 0; i < n; i++){
+      if((pages[i] = kalloc()) == 0)
+        break;
+    }
+    if(i == 0)
+      return -1;
+    n = i;
+  }
+
+  // other processes may take p's resident pages while it
+  // waits; they leave these PTEs, which aren't valid, alone.
+  p->swappable = 1;
+  if(blk)
+    virtio_disk_rwblock(swap.start + slot * SLOTBLOCKS, blk, n, 0);
+  else
+    virtio_disk_rwpages(swap.start + slot * SLOTBLOCKS, pages, n, 0);
+  p->swappable = 0;
+
+  for(i = 0; i < n; i++){
+    *ptes[i] = PA2PTE(pages[i]) | (*ptes[i] & (PTE_R|PTE_W|PTE_X|PTE_U)) |
+      PTE_V | PTE_A;
+    slotfree(slot + i);
+  }
+  proctlbstale(p);
+
+out:
+  if(n > 0){
+    p->rss += n;
+    __sync_fetch_and_add(&swap.nfault[!z], 1);
+    __sync_fetch_and_add(&swap.faulttime[!z], r_time() - t0);
+  }
+  return n;
+}
+
+// read the current process's swapped-out pages in
+// [va, va+len) back into memory. returns the number of
+// pages read, 0 if there were none (or the caller can't
+// wait for the disk), or -1 if out of memory.
+int
+swapin(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  uint64 a, end;
+  int n, tot;
+
+  if(len == 0 || !canwait() || va >= p->sz)
+    return 0;
+  end = (len > p->sz - va) ? p->sz : va + len;
+
+  tot = 0;
+  for(a = PGROUNDDOWN(va); a < end; a += PGSIZE){
+    if((n = readin(p, a)) < 0)
+      return -1;
+    tot += n;
+  }
+  return tot;
+}
+
+// describe swapping, for the statistics device.
+int
+swapstats(char *buf, int sz)
+{
+  char *name[] = { "zram", "disk" };
+  int i, n, f;
+
+  n = zramstats(buf, sz);
+  n += snprintf(buf + n, sz - n, "disk: %d pages in %d slots\n",
+                swap.ndisk, swap.nslot);
+  for(i = 0; i < 2; i++){
+    f = swap.nfault[i];
+    n += snprintf(buf + n, sz - n, "%s: %d faults, %d us/fault\n", name[i], f,
+                  f ? (int)(swap.faulttime[i] / f / TIMEUS) : 0);
+  }
+  return n;
+}
@@ -101,6 +101,12 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
+extern uint64 sys_dmesg(void);
+extern uint64 sys_sendfile(void);
+extern uint64 sys_shmmap(void);
+extern uint64 sys_shmunlink(void);
+extern uint64 sys_futexwait(void);
+extern uint64 sys_futexwake(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -126,6 +132,12 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_dmesg]   sys_dmesg,
+[SYS_sendfile] sys_sendfile,
+[SYS_shmmap]  sys_shmmap,
+[SYS_shmunlink] sys_shmunlink,
+[SYS_futexwait] sys_futexwait,
+[SYS_futexwake] sys_futexwake,
 };
 
 void
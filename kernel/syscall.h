@@ -20,3 +20,14 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_dmesg  22
+#define SYS_sendfile 23
+#define SYS_shmmap 24
+#define SYS_shmunlink 25
+#define SYS_futexwait 26
+#define SYS_futexwake 27
+
+// system calls that uservec in trampoline.S runs on its fast
+// path: they must not sleep, fault, or need interrupts, since
+// they run with interrupts off and stvec still at uservec.
+#define SYSFAST ((1 << SYS_getpid) | (1 << SYS_uptime))
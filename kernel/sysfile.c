@@ -94,6 +94,20 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+// copy up to n bytes from fd in to fd out
+// without passing them through user space.
+uint64
+sys_sendfile(void)
+{
+  struct file *out, *in;
+  int n;
+
+  argint(2, &n);
+  if(argfd(0, 0, &out) < 0 || argfd(1, 0, &in) < 0)
+    return -1;
+  return filesend(out, in, n);
+}
+
 uint64
 sys_close(void)
 {
@@ -232,6 +246,8 @@ sys_unlink(void)
   iupdate(ip);
   iunlockput(ip);
 
+  execflush();
+
   end_op();
 
   return 0;
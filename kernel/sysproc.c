@@ -79,6 +79,62 @@ sys_kill(void)
   return kill(pid);
 }
 
+// copy the tail of the kernel log to a user buffer.
+uint64
+sys_dmesg(void)
+{
+  uint64 buf;
+  int n;
+
+  argaddr(0, &buf);
+  argint(1, &n);
+  return klogread(buf, n);
+}
+
+// map a named shared memory segment, creating it
+// if need be.
+uint64
+sys_shmmap(void)
+{
+  char name[SHMNAME];
+  int sz;
+
+  if(argstr(0, name, sizeof(name)) < 0)
+    return -1;
+  argint(1, &sz);
+  return shmmap(name, sz);
+}
+
+uint64
+sys_shmunlink(void)
+{
+  char name[SHMNAME];
+
+  if(argstr(0, name, sizeof(name)) < 0)
+    return -1;
+  return shmunlink(name);
+}
+
+uint64
+sys_futexwait(void)
+{
+  uint64 addr;
+  int val;
+
+  argaddr(0, &addr);
+  argint(1, &val);
+  return futexwait(addr, val);
+}
+
+uint64
+sys_futexwake(void)
+{
+  uint64 addr;
+
+  argaddr(0, &addr);
+  return futexwake(addr);
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 uint64
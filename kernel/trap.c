@@ -4,17 +4,21 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "syscall.h"
 #include "defs.h"
 
 struct spinlock tickslock;
 uint ticks;
+int sysfast = 1;   // take the SYSFAST path; the stats device sets it
 
 extern char trampoline[], uservec[], userret[];
+extern char copyuser_start[], copyuser_end[], copyuser_fault[];
 
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
 extern int devintr();
+static void pagefault(struct proc *);
 
 void
 trapinit(void)
@@ -67,6 +71,8 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    pagefault(p);
   } else {
     printf("usertrap(): unexpected scause 0x%lx pid=%d\n", r_scause(), p->pid);
     printf("            sepc=0x%lx stval=0x%lx\n", r_sepc(), r_stval());
@@ -76,13 +82,57 @@ usertrap(void)
   if(killed(p))
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if this is a timer interrupt. while
+  // p waits to run again, the kernel is holding nothing
+  // of its memory, so its pages may be swapped out.
+  if(which_dev == 2){
+    p->swappable = 1;
     yield();
+    p->swappable = 0;
+  }
 
   usertrapret();
 }
 
+//
+// a page fault from user space: read the page in if it
+// is out on swap, or copy it if ksm.c shares it and this
+// is a write, and otherwise kill the process.
+//
+static void
+pagefault(struct proc *p)
+{
+  uint64 scause = r_scause();
+  uint64 stval = r_stval();
+
+  // uvmfaultuser() may wait for the disk.
+  intr_on();
+
+  if(uvmfaultuser(stval, scause == 15) <= 0){
+    printf("usertrap(): unexpected scause 0x%lx pid=%d\n", scause, p->pid);
+    printf("            sepc=0x%lx stval=0x%lx\n", p->trapframe->epc, stval);
+    setkilled(p);
+  }
+}
+
+//
+// the fast path for system calls in SYSFAST, called from
+// trampoline.S on the kernel stack and page table, with
+// interrupts off. returns the user page table for
+// trampoline.S to switch back to.
+//
+uint64
+usertrapfast(void)
+{
+  struct proc *p = myproc();
+  uint64 satp;
+
+  syscall();
+  satp = procsatp(p);
+  p->trapframe->kernel_satp = satp;
+  return satp;
+}
+
 //
 // return to user space
 //
@@ -100,11 +150,16 @@ usertrapret(void)
   uint64 trampoline_uservec = TRAMPOLINE + (uservec - trampoline);
   w_stvec(trampoline_uservec);
 
+  // the process's page table, which maps the kernel too.
+  uint64 satp = procsatp(p);
+
   // set up trapframe values that uservec will need when
   // the process next traps into the kernel.
-  p->trapframe->kernel_satp = r_satp();         // kernel page table
+  p->trapframe->kernel_satp = satp;             // page table with the kernel
   p->trapframe->kernel_sp = p->kstack + PGSIZE; // process's kernel stack
   p->trapframe->kernel_trap = (uint64)usertrap;
+  p->trapframe->kernel_fast = (uint64)usertrapfast;
+  p->trapframe->sysfast = sysfast ? SYSFAST : 0;
   p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
 
   // set up the registers that trampoline.S's sret will use
@@ -119,9 +174,6 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
-
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
@@ -144,7 +196,15 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  // don't leave user memory open to whatever runs
+  // next; kernelvec restores sstatus on the way back.
+  w_sstatus(sstatus & ~SSTATUS_SUM);
+
+  if((scause == 13 || scause == 15) &&
+     sepc >= (uint64)copyuser_start && sepc < (uint64)copyuser_end){
+    // a page fault in copyuser(): return -1 from it.
+    sepc = (uint64)copyuser_fault;
+  } else if((which_dev = devintr()) == 0){
     // interrupt or trap from an unknown source
     printf("scause=0x%lx sepc=0x%lx stval=0x%lx\n", scause, r_sepc(), r_stval());
     panic("kerneltrap");
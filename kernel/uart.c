@@ -38,13 +38,21 @@
 #define ReadReg(reg) (*(Reg(reg)))
 #define WriteReg(reg, v) (*(Reg(reg)) = (v))
 
+// the 16550a transmit FIFO holds this many bytes.
+#define UART_FIFO_SIZE 16
+
 // the transmit output buffer.
+// large enough that write()rs rarely have to wait
+// for the UART to drain it.
 struct spinlock uart_tx_lock;
-#define UART_TX_BUF_SIZE 32
+#define UART_TX_BUF_SIZE 4096
 char uart_tx_buf[UART_TX_BUF_SIZE];
 uint64 uart_tx_w; // write next to uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE]
 uint64 uart_tx_r; // read next from uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE]
 
+// set while the console has no room for input.
+static volatile int uart_rx_off;
+
 extern volatile int panicked; // from printf.c
 
 void uartstart();
@@ -77,34 +85,42 @@ uartinit(void)
   initlock(&uart_tx_lock, "uart");
 }
 
-// add a character to the output buffer and tell the
+// add n bytes from buf to the output buffer and tell the
 // UART to start sending if it isn't already.
-// blocks if the output buffer is full.
+// blocks while the output buffer is full.
 // because it may block, it can't be called
 // from interrupts; it's only suitable for use
 // by write().
 void
-uartputc(int c)
+uartwrite(char *buf, int n)
 {
+  int i;
+
   acquire(&uart_tx_lock);
 
   if(panicked){
     for(;;)
       ;
   }
-  while(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE){
-    // buffer is full.
-    // wait for uartstart() to open up space in the buffer.
-    sleep(&uart_tx_r, &uart_tx_lock);
+  i = 0;
+  while(i < n){
+    while(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE){
+      // buffer is full.
+      // wait for uartstart() to open up space in the buffer.
+      uartstart();
+      sleep(&uart_tx_r, &uart_tx_lock);
+    }
+    while(i < n && uart_tx_w < uart_tx_r + UART_TX_BUF_SIZE){
+      uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE] = buf[i++];
+      uart_tx_w += 1;
+    }
   }
-  uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE] = c;
-  uart_tx_w += 1;
   uartstart();
   release(&uart_tx_lock);
 }
 
 
-// alternate version of uartputc() that doesn't 
+// alternate version of uartwrite() that doesn't 
 // use interrupts, for use by kernel printf() and
 // to echo characters. it spins waiting for the uart's
 // output register to be empty.
@@ -126,37 +142,58 @@ uartputc_sync(int c)
   pop_off();
 }
 
-// if the UART is idle, and a character is waiting
-// in the transmit buffer, send it.
+// if the UART is idle, and characters are waiting in the
+// kernel log or the transmit buffer, send up to a FIFO's worth.
+// kernel log output goes first.
 // caller must hold uart_tx_lock.
-// called from both the top- and bottom-half.
+// called from both the top- and bottom-half,
+// so it doesn't wake up writers; callers that can do so should
+// wakeup(&uart_tx_r) once they have released uart_tx_lock.
 void
 uartstart()
 {
-  while(1){
-    if(uart_tx_w == uart_tx_r){
-      // transmit buffer is empty.
-      ReadReg(ISR);
-      return;
-    }
-    
-    if((ReadReg(LSR) & LSR_TX_IDLE) == 0){
-      // the UART transmit holding register is full,
-      // so we cannot give it another byte.
-      // it will interrupt when it's ready for a new byte.
-      return;
-    }
-    
-    int c = uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE];
+  char buf[UART_FIFO_SIZE];
+  int i, n;
+
+  if((ReadReg(LSR) & LSR_TX_IDLE) == 0){
+    // the UART transmit FIFO still holds bytes,
+    // so we cannot give it another burst.
+    // it will interrupt when it's ready for more.
+    return;
+  }
+
+  // the FIFO is empty, so it can take UART_FIFO_SIZE
+  // bytes without further checks of LSR.
+  n = klogflush(buf, UART_FIFO_SIZE);
+  for(i = 0; i < n; i++)
+    WriteReg(THR, buf[i]);
+  for(; i < UART_FIFO_SIZE && uart_tx_r != uart_tx_w; i++){
+    WriteReg(THR, uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE]);
     uart_tx_r += 1;
-    
-    // maybe uartputc() is waiting for space in the buffer.
-    wakeup(&uart_tx_r);
-    
-    WriteReg(THR, c);
+  }
+
+  if(i == 0){
+    // nothing to send.
+    ReadReg(ISR);
   }
 }
 
+// start the UART sending any new kernel log output.
+// called by printf(), perhaps with a p->lock held, so it
+// mustn't take uart_tx_lock: uartwrite() holds that lock
+// when it calls sleep(), which takes p->lock. instead,
+// turn transmit interrupts off and on again, which makes
+// a 16550 with an empty transmit register interrupt, and
+// let uartintr() send the log.
+void
+uartkick(void)
+{
+  int ier = uart_rx_off ? 0 : IER_RX_ENABLE;
+
+  WriteReg(IER, ier);
+  WriteReg(IER, ier | IER_TX_ENABLE);
+}
+
 // read one input character from the UART.
 // return -1 if none is waiting.
 int
@@ -170,22 +207,48 @@ uartgetc(void)
   }
 }
 
+// turn receive interrupts on or off, for console
+// flow control. while they are off, input waits
+// in the UART (and in qemu) rather than being lost.
+// caller must hold the console lock.
+void
+uartrxenable(int on)
+{
+  uart_rx_off = !on;
+  if(on)
+    WriteReg(IER, IER_TX_ENABLE | IER_RX_ENABLE);
+  else
+    WriteReg(IER, IER_TX_ENABLE);
+}
+
 // handle a uart interrupt, raised because input has
 // arrived, or the uart is ready for more output, or
 // both. called from devintr().
 void
 uartintr(void)
 {
-  // read and process incoming characters.
-  while(1){
+  // read and process incoming characters, until
+  // there are no more or the console has no room.
+  while(!uart_rx_off){
     int c = uartgetc();
     if(c == -1)
       break;
-    consoleintr(c);
+    if(consoleintr(c) == 0)
+      break;
   }
 
+  // a racing uartkick() and uartrxenable() may have left
+  // receive interrupts in the wrong state.
+  if(uart_rx_off)
+    WriteReg(IER, IER_TX_ENABLE);
+  else
+    WriteReg(IER, IER_TX_ENABLE | IER_RX_ENABLE);
+
   // send buffered characters.
   acquire(&uart_tx_lock);
   uartstart();
   release(&uart_tx_lock);
+
+  // maybe uartwrite() is waiting for space in the buffer.
+  wakeup(&uart_tx_r);
 }
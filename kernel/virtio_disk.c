@@ -11,6 +11,7 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
@@ -19,6 +20,16 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
+// block reads and writes from bio.c wait in a queue, sorted
+// by block number, and go to the device one batch at a time:
+// the next request at or after where the last batch ended
+// (C-SCAN), with the requests for the blocks that follow it
+// merged into one virtio request. a request that has waited
+// IODEADLINE ticks goes next regardless, and a process that
+// has had IOQUANTUM batches in a row gives way to others.
+#define IODEADLINE 5
+#define IOQUANTUM  4
+
 static struct disk {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
@@ -46,7 +57,8 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    int *busy;   // cleared, and woken up, when the request is done
+    struct buf *batch;  // or the queued bufs it was, through qnext
     char status;
   } info[NUM];
 
@@ -55,7 +67,19 @@ static struct disk {
   struct virtio_blk_req ops[NUM];
   
   struct spinlock vdisk_lock;
-  
+
+  // the request queue.
+  struct buf *queue;  // waiting bufs, through qnext, by block
+  int qbusy;          // a batch from the queue is in flight
+  uint headpos;       // the block after the last batch
+  int lastpid;        // who the last batch was for
+  int nsame;          // and how many batches in a row
+  int nwaiting;       // disk_rw() callers waiting for descriptors
+
+  // statistics.
+  int nreq;           // requests queued
+  int nbatch;         // batches sent to the device
+  int ndeadline;      // batches sent because of IODEADLINE
 } disk;
 
 void
@@ -196,12 +220,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +235,17 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// hand the device a request for n consecutive len-byte
+// pieces of the disk, starting at sector, to or from the n
+// buffers in data[], using the n+2 descriptors in idx[].
+static void
+submit(int *idx, uint64 sector, char **data, int n, int len, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
-
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // a descriptor for type/reserved/sector, one or more for the
+  // data, and one for a 1-byte status result.
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
-
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,24 +262,22 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 1; i <= n; i++){
+    disk.desc[idx[i]].addr = (uint64) data[i-1];
+    disk.desc[idx[i]].len = len;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads data[i-1]
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes data[i-1]
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -279,18 +290,201 @@ virtio_disk_rw(struct buf *b, int write)
   __sync_synchronize();
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+// the first queued buf at or after the head position, in
+// C-SCAN order, that isn't for process pid. returns the
+// link that points to it, or 0.
+static struct buf**
+cscan(int pid)
+{
+  struct buf **pp, **first;
+
+  first = 0;
+  for(pp = &disk.queue; *pp; pp = &(*pp)->qnext){
+    if((*pp)->qpid == pid)
+      continue;
+    if((*pp)->blockno >= disk.headpos)
+      return pp;
+    if(first == 0)
+      first = pp;
+  }
+  return first;   // wrap around to the lowest block
+}
+
+// choose the queued buf to start the next batch with.
+static struct buf**
+pick(void)
+{
+  struct buf **pp, **old;
+
+  old = 0;
+  for(pp = &disk.queue; *pp; pp = &(*pp)->qnext)
+    if(old == 0 || (int)((*pp)->qtime - (*old)->qtime) < 0)
+      old = pp;
+  if(ticks - (*old)->qtime >= IODEADLINE){
+    disk.ndeadline++;
+    return old;
+  }
+  if(disk.nsame >= IOQUANTUM && (pp = cscan(disk.lastpid)) != 0)
+    return pp;
+  return cscan(-1);
+}
+
+// send the next batch from the queue to the device, unless
+// one is in flight already. caller holds vdisk_lock.
+static void
+dispatch(void)
+{
+  int idx[NUM];
+  char *data[NUM];
+  struct buf **pp, *b, *q, *last;
+  int i, n;
+
+  if(disk.qbusy || disk.queue == 0 || disk.nwaiting > 0)
+    return;
+  pp = pick();
+  b = last = *pp;
+  n = 1;
+  while(n < NUM - 2 && last->qnext && last->qnext->blockno == last->blockno + 1 &&
+        last->qnext->qwrite == b->qwrite){
+    last = last->qnext;
+    n++;
+  }
+  if(allocn_desc(idx, n + 2) < 0)
+    return;  // disk_rw() has the descriptors; it dispatches when done
+
+  *pp = last->qnext;
+  last->qnext = 0;
+  disk.info[idx[0]].busy = 0;
+  disk.info[idx[0]].batch = b;
+  for(i = 0, q = b; i < n; i++, q = q->qnext)
+    data[i] = (char *) q->data;
+
+  disk.qbusy = 1;
+  disk.nbatch++;
+  disk.headpos = b->blockno + n;
+  if(b->qpid == disk.lastpid)
+    disk.nsame++;
+  else {
+    disk.lastpid = b->qpid;
+    disk.nsame = 1;
+  }
+  submit(idx, (uint64)b->blockno * (BSIZE / 512), data, n, BSIZE, b->qwrite);
+}
+
+// read or write n consecutive len-byte pieces of the disk,
+// starting at sector, to or from the n buffers in data[],
+// as a single request, bypassing the queue. waits for the
+// request to finish.
+static void
+disk_rw(uint64 sector, char **data, int n, int len, int write)
+{
+  int idx[NUM];
+  int busy;
+
+  if(n < 1 || n > NUM - 2)
+    panic("disk_rw");
+
+  acquire(&disk.vdisk_lock);
+
+  // allocate the descriptors.
+  while(1){
+    if(allocn_desc(idx, n + 2) == 0) {
+      break;
+    }
+    // keep the queue from taking them first.
+    disk.nwaiting++;
+    sleep(&disk.free[0], &disk.vdisk_lock);
+    disk.nwaiting--;
+  }
+
+  // record the flag to clear for virtio_disk_intr().
+  busy = 1;
+  disk.info[idx[0]].busy = &busy;
+  disk.info[idx[0]].batch = 0;
+  submit(idx, sector, data, n, len, write);
+
+  // Wait for virtio_disk_intr() to say request has finished.
+  while(busy) {
+    sleep(&busy, &disk.vdisk_lock);
+  }
+
+  disk.info[idx[0]].busy = 0;
+  free_chain(idx[0]);
+  dispatch();   // the queue may have been waiting for descriptors
+
+  release(&disk.vdisk_lock);
+}
+
+// add b to the queue. caller holds vdisk_lock.
+static void
+enqueue(struct buf *b, int write)
+{
+  struct proc *p = myproc();
+  struct buf **pp;
+
+  b->disk = 1;
+  b->qwrite = write;
+  b->qtime = ticks;
+  b->qpid = p ? p->pid : 0;
+  for(pp = &disk.queue; *pp && (*pp)->blockno < b->blockno; pp = &(*pp)->qnext)
+    ;
+  b->qnext = *pp;
+  *pp = b;
+  disk.nreq++;
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  acquire(&disk.vdisk_lock);
+  enqueue(b, write);
+  dispatch();
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  release(&disk.vdisk_lock);
+}
+
+// write n bufs, queueing them all at once, so that the
+// queue can sort them and merge neighbours.
+void
+virtio_disk_writebufs(struct buf **bs, int n)
+{
+  int i;
 
+  acquire(&disk.vdisk_lock);
+  for(i = 0; i < n; i++)
+    enqueue(bs[i], 1);
+  dispatch();
+  for(i = 0; i < n; i++){
+    while(bs[i]->disk == 1)
+      sleep(bs[i], &disk.vdisk_lock);
+  }
   release(&disk.vdisk_lock);
 }
 
+// read or write n pages at consecutive blocks starting
+// at blockno, in one request. for swap.c.
+void
+virtio_disk_rwpages(uint blockno, char **pages, int n, int write)
+{
+  disk_rw((uint64)blockno * (BSIZE / 512), pages, n, PGSIZE, write);
+}
+
+// read or write n physically contiguous pages at pa, at
+// consecutive blocks starting at blockno, with a single
+// data descriptor. for swap.c.
+void
+virtio_disk_rwblock(uint blockno, char *pa, int n, int write)
+{
+  disk_rw((uint64)blockno * (BSIZE / 512), &pa, 1, n * PGSIZE, write);
+}
+
 void
 virtio_disk_intr()
 {
@@ -316,12 +510,39 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    struct buf *b = disk.info[id].batch;
+    if(b){
+      // a batch from the queue.
+      disk.info[id].batch = 0;
+      for(; b; b = b->qnext){
+        b->disk = 0;   // disk is done with buf
+        wakeup(b);
+      }
+      free_chain(id);
+      disk.qbusy = 0;
+    } else {
+      int *busy = disk.info[id].busy;
+      *busy = 0;   // disk is done with the request
+      wakeup(busy);
+    }
 
     disk.used_idx += 1;
   }
 
+  dispatch();
+
+  release(&disk.vdisk_lock);
+}
+
+// describe the request queue, for the statistics device.
+int
+diskstats(char *buf, int sz)
+{
+  int n;
+
+  acquire(&disk.vdisk_lock);
+  n = snprintf(buf, sz, "disk: %d requests in %d batches, %d past deadline\n",
+               disk.nreq, disk.nbatch, disk.ndeadline);
   release(&disk.vdisk_lock);
+  return n;
 }
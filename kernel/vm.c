@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -61,15 +63,99 @@ kvminit(void)
 void
 kvminithart()
 {
+  uint64 bits;
+
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  // find out how many ASID bits the hart implements,
+  // by writing all ones and seeing which stick.
+  // the implemented bits are the low-order ones.
+  w_satp(MAKE_SATP(kernel_pagetable, SATP_ASID_MASK));
+  bits = (r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+  for(nasid = 1; bits & 1; bits >>= 1)
+    nasid <<= 1;
+
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Switch this hart to satp: the kernel's page table, or a
+// process's, which maps the kernel too. Without ASIDs, TLB
+// entries from different page tables can't be told apart,
+// so flush the TLB.
+void
+kvmswitch(uint64 satp)
+{
+  if(nasid > 1){
+    w_satp(satp);
+  } else {
+    sfence_vma();
+    w_satp(satp);
+    sfence_vma();
+  }
+}
+
+// Make the user page table pagetable map the kernel as well,
+// so that the kernel can run on it and reach user memory with
+// plain loads and stores (see copyin()). The kernel's own
+// page-table pages are shared, not copied; the kernel's
+// mappings never change after boot. kvmunshare() detaches
+// them before the user page table is freed.
+int
+kvmshare(pagetable_t pagetable)
+{
+  pagetable_t ul1, kl1;
+  pte_t *pte;
+  int i;
+
+  // the devices, in the first gigabyte beside user memory.
+  if((pagetable[0] & PTE_V) == 0){
+    if((ul1 = (pagetable_t)kalloc_zeroed()) == 0)
+      return -1;
+    pagetable[0] = PA2PTE(ul1) | PTE_V;
+  }
+  ul1 = (pagetable_t)PTE2PA(pagetable[0]);
+  kl1 = (pagetable_t)PTE2PA(kernel_pagetable[0]);
+  for(i = PX(1, MAXUVA); i < 512; i++)
+    ul1[i] = kl1[i];
+
+  // kernel text and data, and the RAM.
+  for(i = 1; i < PX(2, TRAMPOLINE); i++)
+    pagetable[i] = kernel_pagetable[i];
+
+  // the kernel stacks, beside the trampoline.
+  for(i = 0; i < NPROC; i++){
+    if((pte = walk(pagetable, KSTACK(i), 1)) == 0)
+      return -1;
+    *pte = *walk(kernel_pagetable, KSTACK(i), 0);
+  }
+  return 0;
+}
+
+// Undo kvmshare(), so that freeing pagetable
+// leaves the kernel's page-table pages alone.
+void
+kvmunshare(pagetable_t pagetable)
+{
+  pagetable_t ul1;
+  pte_t *pte;
+  int i;
+
+  if(pagetable[0] & PTE_V){
+    ul1 = (pagetable_t)PTE2PA(pagetable[0]);
+    for(i = PX(1, MAXUVA); i < 512; i++)
+      ul1[i] = 0;
+  }
+  for(i = 1; i < PX(2, TRAMPOLINE); i++)
+    pagetable[i] = 0;
+  for(i = 0; i < NPROC; i++)
+    if((pte = walk(pagetable, KSTACK(i), 0)) != 0)
+      *pte = 0;
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -93,9 +179,8 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
@@ -171,43 +256,138 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
-// Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
-void
-uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+// pages that uvmunmap() has unmapped, to be freed once
+// no TLB can hold them.
+#define UNMAPBATCH 32
+
+struct unmap {
+  pagetable_t pagetable;
+  int do_free;
+  int n;
+  void *pages[UNMAPBATCH];
+};
+
+// flush this hart's TLB, if it is running on u->pagetable,
+// and then free the pages. other harts needn't flush now:
+// a process runs on one hart at a time, and the callers'
+// proctlbstale() makes the others flush before they run
+// it again.
+static void
+unmapflush(struct unmap *u)
 {
-  uint64 a;
+  uint64 satp = r_satp();
+
+  if(u->n == 0)
+    return;
+  if(MAKE_SATP(u->pagetable, 0) == (satp & ~(SATP_ASID_MASK << SATP_ASID_SHIFT))){
+    if(nasid > 1)
+      sfence_vma_asid((satp >> SATP_ASID_SHIFT) & SATP_ASID_MASK);
+    else
+      sfence_vma();
+  }
+  while(u->n > 0)
+    kfree(u->pages[--u->n]);
+}
+
+static void
+unmapfree(struct unmap *u, void *pa)
+{
+  if(u->n == UNMAPBATCH)
+    unmapflush(u);
+  u->pages[u->n++] = pa;
+}
+
+static int
+ptempty(pagetable_t pt)
+{
+  int i;
+
+  for(i = 0; i < 512; i++)
+    if(pt[i])
+      return 0;
+  return 1;
+}
+
+// unmap [va, end) from pt, a page-table page at level,
+// visiting each PTE once. frees page-table pages that
+// are left empty.
+static void
+unmaplevel(struct unmap *u, pagetable_t pt, int level, uint64 va, uint64 end)
+{
+  uint64 a, next, span;
+  pagetable_t child;
   pte_t *pte;
 
-  if((va % PGSIZE) != 0)
-    panic("uvmunmap: not aligned");
+  span = 1UL << PXSHIFT(level);
+  for(a = va; a < end; a = next){
+    next = (a & ~(span - 1)) + span;
+    if(next > end)
+      next = end;
+    pte = &pt[PX(level, a)];
+
+    if(level > 0){
+      if((*pte & PTE_V) == 0)
+        panic("uvmunmap: walk");
+      if(PTE_FLAGS(*pte) != PTE_V)
+        panic("uvmunmap: superpage");
+      child = (pagetable_t)PTE2PA(*pte);
+      unmaplevel(u, child, level - 1, a, next);
+      // a last-level table that was wholly unmapped is
+      // empty; others have to be looked at.
+      if((level == 1 && next - a == span) || ptempty(child)){
+        *pte = 0;
+        unmapfree(u, child);
+      }
+      continue;
+    }
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+    if((*pte & (PTE_V|PTE_SWAP)) == PTE_SWAP){
+      // the page is out on swap.
+      if(u->do_free)
+        swapfree(*pte);
+      *pte = 0;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
       panic("uvmunmap: not mapped");
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
-    }
+    if(u->do_free)
+      unmapfree(u, (void*)PTE2PA(*pte));
     *pte = 0;
   }
 }
 
+// Remove npages of mappings starting from va. va must be
+// page-aligned. The mappings must exist.
+// Optionally free the physical memory. Page-table pages
+// left empty are freed.
+void
+uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+  struct unmap u;
+
+  if((va % PGSIZE) != 0)
+    panic("uvmunmap: not aligned");
+  if(npages == 0)
+    return;
+
+  u.pagetable = pagetable;
+  u.do_free = do_free;
+  u.n = 0;
+  unmaplevel(&u, pagetable, 2, va, va + npages*PGSIZE);
+  unmapflush(&u);
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -221,8 +401,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -237,15 +416,16 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   if(newsz < oldsz)
     return oldsz;
+  if(newsz > MAXUVA)
+    return 0;
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -273,6 +453,22 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
   return newsz;
 }
 
+// the number of resident pages that uvmdealloc(pagetable,
+// oldsz, newsz) would free.
+int
+uvmrss(pagetable_t pagetable, uint64 newsz, uint64 oldsz)
+{
+  uint64 a;
+  pte_t *pte;
+  int n;
+
+  n = 0;
+  for(a = PGROUNDUP(newsz); a < PGROUNDUP(oldsz); a += PGSIZE)
+    if((pte = walk(pagetable, a, 0)) != 0 && (*pte & PTE_V))
+      n++;
+  return n;
+}
+
 // Recursively free page-table pages.
 // All leaf mappings must already have been removed.
 void
@@ -306,7 +502,8 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 // Given a parent process's page table, copy
 // its memory into a child's page table.
 // Copies both the page table and the
-// physical memory.
+// physical memory, except for shm.c's
+// segments, which the child shares.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
@@ -320,13 +517,42 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   for(i = 0; i < sz; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
       panic("uvmcopy: pte should exist");
+    if((*pte & (PTE_V|PTE_SHARED)) == (PTE_V|PTE_SHARED)){
+      pa = PTE2PA(*pte);
+      kdup((void*)pa);
+      if(mappages(new, i, PGSIZE, pa, PTE_FLAGS(*pte)) != 0){
+        kfree((void*)pa);
+        goto err;
+      }
+      continue;
+    }
+    if((mem = kalloc()) == 0)
+      goto err;
+    // kalloc() may have swapped the page out; bring
+    // it back before looking at it.
+    if((*pte & (PTE_V|PTE_SWAP)) == PTE_SWAP && swapin(i, PGSIZE) <= 0){
+      kfree(mem);
+      goto err;
+    }
     if((*pte & PTE_V) == 0)
       panic("uvmcopy: page not present");
-    pa = PTE2PA(*pte);
+    // hold a reference to the frame while copying it: if
+    // this process is preempted, ksmd may merge the page
+    // and free the frame. check the PTE still maps it once
+    // the reference is held.
+    for(;;){
+      pa = PTE2PA(*pte);
+      if(kdup((void*)pa)){
+        if(PTE2PA(*pte) == pa)
+          break;
+        kfree((void*)pa);
+      }
+    }
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
+    if(flags & PTE_COW)
+      flags = (flags & ~PTE_COW) | PTE_W;  // the child's copy is its own
     memmove(mem, (char*)pa, PGSIZE);
+    kfree((void*)pa);
     if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
       kfree(mem);
       goto err;
@@ -349,7 +575,102 @@ uvmclear(pagetable_t pagetable, uint64 va)
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  // execute-only and without PTE_U, so that the kernel's
+  // direct loads and stores (see copyuser()) fault too.
+  *pte = (*pte & ~(PTE_U|PTE_R|PTE_W)) | PTE_X;
+}
+
+// give the current process its own copy of the page
+// ksm.c shares at pte, so that it can write it. the last
+// user of a shared page keeps it. returns 0, or -1 if out
+// of memory.
+static int
+cowcopy(struct proc *p, pte_t *pte)
+{
+  char *pa, *mem;
+
+  pa = (char*)PTE2PA(*pte);
+  if(kref(pa) == 1){
+    ksmforget(pa);  // so that no one can share it again
+    if(kref(pa) == 1){
+      *pte = (*pte & ~PTE_COW) | PTE_W;
+      proctlbstale(p);
+      return 0;
+    }
+  }
+  if((mem = kalloc()) == 0)
+    return -1;
+  pa = (char*)PTE2PA(*pte);
+  memmove(mem, pa, PGSIZE);
+  *pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  proctlbstale(p);
+  kfree(pa);
+  return 0;
+}
+
+static int
+fault(uint64 va, uint64 len, int write)
+{
+  struct proc *p = myproc();
+  uint64 a, end;
+  pte_t *pte;
+  int n;
+
+  if((n = swapin(va, len)) < 0)
+    return -1;
+  if(!write || len == 0 || va >= p->sz)
+    return n;
+  end = (len > p->sz - va) ? p->sz : va + len;
+  for(a = PGROUNDDOWN(va); a < end; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte && (*pte & (PTE_V|PTE_U|PTE_COW)) == (PTE_V|PTE_U|PTE_COW)){
+      if(cowcopy(p, pte) < 0)
+        return -1;
+      n++;
+    }
+  }
+  return n;
+}
+
+// make the current process's pages in [va, va+len) usable
+// after a fault: read them in from swap, and if write is
+// set, copy those that ksm.c shares. returns the number of
+// pages that needed it, 0 if there were none (or the caller
+// can't wait for the disk), or -1 if out of memory. the
+// caller, copyin() or the like, may hold an inode's lock
+// or be in a log op, so if memory runs out it only starts
+// oomkill() freeing some, and fails.
+int
+uvmfault(uint64 va, uint64 len, int write)
+{
+  int n;
+
+  if((n = fault(va, len, write)) < 0)
+    oomkill(0);
+  return n;
+}
+
+// uvmfault() for a page fault in user space, where the
+// process holds no locks, and so can wait for oomkill().
+int
+uvmfaultuser(uint64 va, int write)
+{
+  int n;
+
+  while((n = fault(va, 1, write)) < 0 && oomkill(1))
+    ;
+  return n;
+}
+
+// can the kernel reach [va, va+len) in pagetable with
+// copyuser()? only if it is running on pagetable.
+static int
+usercopyok(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+
+  return p != 0 && p->pagetable == pagetable &&
+    va < MAXUVA && len <= MAXUVA - va;
 }
 
 // Copy from kernel to user.
@@ -361,6 +682,15 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   uint64 n, va0, pa0;
   pte_t *pte;
 
+  if(usercopyok(pagetable, dstva, len)){
+    // a fault may be on a page that is out on swap,
+    // or one that ksm.c shares.
+    while(copyuser((char*)dstva, src, len) != 0)
+      if(uvmfault(dstva, len, 1) <= 0)
+        return -1;
+    return 0;
+  }
+
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
     if(va0 >= MAXVA)
@@ -390,6 +720,13 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(usercopyok(pagetable, srcva, len)){
+    while(copyuser(dst, (char*)srcva, len) != 0)
+      if(uvmfault(srcva, len, 0) <= 0)
+        return -1;
+    return 0;
+  }
+
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
@@ -417,6 +754,15 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   uint64 n, va0, pa0;
   int got_null = 0;
 
+  if(usercopyok(pagetable, srcva, 1)){
+    if(max > MAXUVA - srcva)
+      max = MAXUVA - srcva;
+    while(copyuserstr(dst, (char*)srcva, max) != 0)
+      if(uvmfault(srcva, max, 0) <= 0)
+        return -1;
+    return 0;
+  }
+
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
@@ -0,0 +1,324 @@
+//
+// a pool of compressed pages in memory: the first place
+// swap.c puts pages it evicts, before the disk.
+//
+// each page is compressed with a small LZ77 coder (the
+// block format of LZ4: a token byte holding literal and
+// match lengths, the literals, and a two-byte offset back
+// to the match). pages of zeroes take no space at all.
+// the compressed pages are packed one after another into
+// pool pages; a pool page is freed when the last page in
+// it is freed. the pool grows by taking over pages that
+// are being evicted, so storing never needs kalloc().
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+
+#define NZENT     65536            // most pages the pool holds
+#define ZPOOLMAX  8192             // most pool pages (32MB)
+#define ZMAXLEN   (PGSIZE / 2)     // store pages that compress this well
+#define NPHYS     ((PHYSTOP - KERNBASE) / PGSIZE)
+
+#define LZHASHBITS 12
+#define LZMINMATCH 4
+
+struct zent {
+  uint page;    // pool page number (see pagenum()), or next free entry
+  ushort off;   // where in the pool page
+  ushort len;   // compressed length; 0 for a page of zeroes
+};
+
+struct {
+  struct spinlock lock;
+  struct zent ent[NZENT];
+  int free;              // first free entry, or -1
+  ushort live[NPHYS];    // entries in each pool page
+  char *open;            // pool page being filled
+  int openoff;           // how much of it is used
+  int npool;             // pool pages
+
+  // statistics.
+  int nstored;           // entries in use
+  int nzero;             // of which zero pages
+  uint64 bytes;          // compressed bytes stored
+
+  // compressor state. only swap.c's reclaimer, which
+  // runs one at a time, stores pages.
+  uchar scratch[ZMAXLEN];
+  ushort table[1 << LZHASHBITS];
+} zram;
+
+static int
+pagenum(char *pa)
+{
+  return ((uint64)pa - KERNBASE) / PGSIZE;
+}
+
+static char *
+pageaddr(int n)
+{
+  return (char *)(KERNBASE + (uint64)n * PGSIZE);
+}
+
+void
+zraminit(void)
+{
+  int i;
+
+  initlock(&zram.lock, "zram");
+  for(i = 0; i < NZENT; i++)
+    zram.ent[i].page = i + 1;
+  zram.ent[NZENT-1].page = -1;
+  zram.free = 0;
+}
+
+static uint
+read32(uchar *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint)p[3] << 24);
+}
+
+// put a length, less the part in the token, as
+// 255s and a final byte less than 255.
+static uchar *
+putlen(uchar *op, int n)
+{
+  for(; n >= 255; n -= 255)
+    *op++ = 255;
+  *op++ = n;
+  return op;
+}
+
+// emit literals [lit, lit+nlit) and then a match of mlen
+// bytes at offset off (or no match, if mlen is 0). returns
+// the new output position, or 0 if it wouldn't fit in end.
+static uchar *
+sequence(uchar *op, uchar *end, uchar *lit, int nlit, int off, int mlen)
+{
+  int ml;
+
+  if(op + 1 + nlit/255 + 1 + nlit + 2 + mlen/255 + 1 > end)
+    return 0;
+  ml = mlen ? mlen - LZMINMATCH : 0;
+  *op++ = ((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15);
+  if(nlit >= 15)
+    op = putlen(op, nlit - 15);
+  memmove(op, lit, nlit);
+  op += nlit;
+  if(mlen){
+    *op++ = off;
+    *op++ = off >> 8;
+    if(ml >= 15)
+      op = putlen(op, ml - 15);
+  }
+  return op;
+}
+
+// compress the page at src into dst, which has room for
+// max bytes. returns the compressed length, or 0 if it
+// doesn't fit.
+static int
+lzcompress(uchar *src, uchar *dst, int max)
+{
+  uchar *op = dst, *end = dst + max;
+  int ip, anchor, ref, len, h;
+  uint x;
+
+  memset(zram.table, 0, sizeof(zram.table));
+  ip = anchor = 0;
+  while(ip + LZMINMATCH <= PGSIZE){
+    x = read32(src + ip);
+    h = (x * 2654435761U) >> (32 - LZHASHBITS);
+    ref = zram.table[h] - 1;  // table holds position + 1
+    zram.table[h] = ip + 1;
+    if(ref < 0 || read32(src + ref) != x){
+      ip++;
+      continue;
+    }
+    for(len = LZMINMATCH; ip + len < PGSIZE && src[ref+len] == src[ip+len]; len++)
+      ;
+    op = sequence(op, end, src + anchor, ip - anchor, ip - ref, len);
+    if(op == 0)
+      return 0;
+    ip += len;
+    anchor = ip;
+  }
+  // the rest as literals, with no match.
+  op = sequence(op, end, src + anchor, PGSIZE - anchor, 0, 0);
+  if(op == 0)
+    return 0;
+  return op - dst;
+}
+
+static int
+getlen(uchar **ipp, int n)
+{
+  uchar c;
+
+  if(n == 15){
+    do {
+      c = *(*ipp)++;
+      n += c;
+    } while(c == 255);
+  }
+  return n;
+}
+
+// decompress len bytes at src into the page dst.
+static void
+lzdecompress(uchar *src, int len, uchar *dst)
+{
+  uchar *ip = src, *iend = src + len;
+  uchar *op = dst, *oend = dst + PGSIZE, *m;
+  int token, n, off;
+
+  for(;;){
+    token = *ip++;
+    n = getlen(&ip, token >> 4);
+    if(op + n > oend || ip + n > iend)
+      panic("lzdecompress");
+    memmove(op, ip, n);
+    op += n;
+    ip += n;
+    if(ip >= iend)
+      break;
+    off = ip[0] | (ip[1] << 8);
+    ip += 2;
+    n = getlen(&ip, token & 15) + LZMINMATCH;
+    m = op - off;
+    if(m < dst || op + n > oend)
+      panic("lzdecompress");
+    while(n-- > 0)   // the match may overlap its copy
+      *op++ = *m++;
+  }
+  if(op != oend)
+    panic("lzdecompress: short");
+}
+
+static int
+iszero(char *page)
+{
+  uint64 *p = (uint64 *)page;
+  int i;
+
+  for(i = 0; i < PGSIZE / sizeof(uint64); i++)
+    if(p[i])
+      return 0;
+  return 1;
+}
+
+// store an evicted page in the pool. returns its entry,
+// and the page is no longer the caller's; or -1 if it
+// doesn't compress well or the pool is full, and the
+// page is untouched.
+int
+zramstore(char *page)
+{
+  int n, e, took;
+  char *old;
+
+  n = 0;
+  if(!iszero(page) && (n = lzcompress((uchar *)page, zram.scratch, ZMAXLEN)) == 0)
+    return -1;
+
+  old = 0;
+  acquire(&zram.lock);
+  took = n > 0 && (zram.open == 0 || zram.openoff + n > PGSIZE);
+  if((e = zram.free) < 0 || (took && zram.npool >= ZPOOLMAX)){
+    release(&zram.lock);
+    return -1;
+  }
+  if(took){
+    // the page itself, now in scratch[], becomes the
+    // next pool page. free the old one if it's empty.
+    if(zram.open && zram.live[pagenum(zram.open)] == 0){
+      old = zram.open;
+      zram.npool--;
+    }
+    zram.open = page;
+    zram.openoff = 0;
+    zram.npool++;
+  }
+  zram.free = zram.ent[e].page;
+  zram.ent[e].len = n;
+  if(n > 0){
+    memmove(zram.open + zram.openoff, zram.scratch, n);
+    zram.ent[e].page = pagenum(zram.open);
+    zram.ent[e].off = zram.openoff;
+    zram.live[pagenum(zram.open)]++;
+    zram.openoff += n;
+    zram.bytes += n;
+  } else {
+    zram.nzero++;
+  }
+  zram.nstored++;
+  release(&zram.lock);
+
+  if(old)
+    kfree(old);
+  if(!took)
+    kfree(page);
+  return e;
+}
+
+// decompress entry e into page.
+void
+zramload(int e, char *page)
+{
+  struct zent *z = &zram.ent[e];
+
+  // the entry keeps its pool page alive until zramfree(),
+  // so this needs no lock.
+  if(z->len == 0)
+    memset(page, 0, PGSIZE);
+  else
+    lzdecompress((uchar *)pageaddr(z->page) + z->off, z->len, (uchar *)page);
+}
+
+void
+zramfree(int e)
+{
+  struct zent *z;
+  char *pa = 0;
+
+  if(e < 0 || e >= NZENT)
+    panic("zramfree");
+  z = &zram.ent[e];
+  acquire(&zram.lock);
+  if(z->len == 0){
+    zram.nzero--;
+  } else {
+    zram.bytes -= z->len;
+    if(--zram.live[z->page] == 0 && pageaddr(z->page) != zram.open){
+      pa = pageaddr(z->page);
+      zram.npool--;
+    }
+  }
+  zram.nstored--;
+  z->page = zram.free;
+  zram.free = e;
+  release(&zram.lock);
+  if(pa)
+    kfree(pa);
+}
+
+// describe the pool, for the statistics device.
+int
+zramstats(char *buf, int sz)
+{
+  int r, n;
+
+  acquire(&zram.lock);
+  n = zram.nstored - zram.nzero;
+  r = zram.npool ? n * 100 / zram.npool : 0;
+  n = snprintf(buf, sz, "zram: %d pages (%d zero) in %d pool pages, %d bytes; ratio %d.%d%d\n",
+               zram.nstored, zram.nzero, zram.npool, (int)zram.bytes,
+               r / 100, (r / 10) % 10, r % 10);
+  release(&zram.lock);
+  return n;
+}
@@ -77,8 +77,18 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc >= 3 && strcmp(argv[1], "-l") == 0){
+    nlog = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-l logblocks] fs.img files...\n");
+    exit(1);
+  }
+  if(nlog < MAXOPBLOCKS+1 || nlog > MAXLOG+1){
+    fprintf(stderr, "mkfs: log must be %d to %d blocks\n",
+            MAXOPBLOCKS+1, (int)MAXLOG+1);
     exit(1);
   }
 
@@ -101,6 +111,8 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.swapstart = xint(FSSIZE);
+  sb.nswap = xint(SWAPBLOCKS);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
          nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
@@ -171,6 +183,11 @@ main(int argc, char *argv[])
 
   balloc(freeblock);
 
+  // the swap area follows the file system. it needs no
+  // initialization, so leave it a hole in the image.
+  if(ftruncate(fsfd, (off_t)(FSSIZE + SWAPBLOCKS) * BSIZE) < 0)
+    die("ftruncate");
+
   exit(0);
 }
 
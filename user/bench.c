@@ -0,0 +1,737 @@
+//
+// Throughput and latency benchmarks.
+// bench            -- run every benchmark
+// bench name ...   -- run just the named benchmarks
+//
+// Times come from uptime(), so they are in clock ticks
+// (about 1/10th of a second); each benchmark does enough
+// work to take at least a few ticks.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/fs.h"
+#include "kernel/file.h"
+#include "user/user.h"
+
+// print a rate as units per second, given a count
+// and a duration in ticks.
+void
+report(char *name, int n, char *unit, int ticks)
+{
+  if(ticks <= 0)
+    ticks = 1;
+  printf("%s: %d %s in %d ticks, %d %s/sec\n",
+         name, n, unit, ticks, (n * 10) / ticks, unit);
+}
+
+// the cycle counter, which the kernel lets user code read.
+uint64
+rdcycle(void)
+{
+  uint64 x;
+  asm volatile("rdcycle %0" : "=r" (x));
+  return x;
+}
+
+// write log-style lines to the console, one write() per line.
+void
+consolebench(char *name)
+{
+  enum { NLINE = 2000, LINESZ = 64 };
+  char line[LINESZ];
+  int i, t0, t1;
+
+  memset(line, 'x', sizeof(line));
+  memmove(line, "bench: log line ", 16);
+  line[LINESZ-1] = '\n';
+
+  t0 = uptime();
+  for(i = 0; i < NLINE; i++){
+    if(write(1, line, sizeof(line)) != sizeof(line)){
+      printf("%s: write failed\n", name);
+      exit(1);
+    }
+  }
+  t1 = uptime();
+  report(name, NLINE * LINESZ / 1024, "KB", t1 - t0);
+}
+
+// create a text file of about kb kilobytes, in lines of
+// varying length, with "needle" on one line in every 64.
+// returns the file's size in bytes.
+int
+maketext(char *file, int kb)
+{
+  char line[128];
+  int fd, i, n, total;
+
+  if((fd = open(file, O_CREATE|O_TRUNC|O_WRONLY)) < 0){
+    printf("bench: cannot create %s\n", file);
+    exit(1);
+  }
+  for(i = 0, total = 0; total < kb * 1024; i++, total += n){
+    n = 32 + (i * 7) % 64;
+    memset(line, 'a' + i % 26, n);
+    if(i % 64 == 0)
+      memmove(line + n/2, "needle", 6);
+    line[n-1] = '\n';
+    if(write(fd, line, n) != n){
+      printf("bench: write %s failed\n", file);
+      exit(1);
+    }
+  }
+  close(fd);
+  return total;
+}
+
+// fork and exec argv with its standard output on fd out.
+int
+spawn(char **argv, int out)
+{
+  int pid;
+
+  if((pid = fork()) < 0){
+    printf("bench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    if(out != 1){
+      close(1);
+      dup(out);
+      close(out);
+    }
+    exec(argv[0], argv);
+    printf("bench: exec %s failed\n", argv[0]);
+    exit(1);
+  }
+  return pid;
+}
+
+// fork and exec argv, and wait for it to finish.
+void
+runprog(char **argv)
+{
+  int xstatus;
+
+  spawn(argv, 1);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("bench: %s failed\n", argv[0]);
+    exit(1);
+  }
+}
+
+// search a file for a plain string and for a pattern
+// with operators. files are limited to MAXFILE blocks,
+// so name the file repeatedly to get a longer run.
+void
+grepbench(char *name)
+{
+  enum { KB = 200, NREP = 16 };
+  char *pats[] = { "needle", "n.*dle$" };
+  char *argv[NREP + 4];
+  int i, j, t0, t1;
+
+  maketext("bench.txt", KB);
+  for(i = 0; i < sizeof(pats)/sizeof(pats[0]); i++){
+    argv[0] = "grep";
+    argv[1] = "-c";
+    argv[2] = pats[i];
+    for(j = 0; j < NREP; j++)
+      argv[3+j] = "bench.txt";
+    argv[3+NREP] = 0;
+    t0 = uptime();
+    runprog(argv);
+    t1 = uptime();
+    printf("%s ", name);
+    report(pats[i], KB * NREP, "KB", t1 - t0);
+  }
+  unlink("bench.txt");
+}
+
+// count a file named many times over, so that wc
+// spreads the names across its worker processes.
+void
+wcbench(char *name)
+{
+  enum { KB = 200, NREP = 16 };
+  char *argv[NREP + 2];
+  int j, t0, t1;
+
+  maketext("bench.txt", KB);
+  argv[0] = "wc";
+  for(j = 0; j < NREP; j++)
+    argv[1+j] = "bench.txt";
+  argv[1+NREP] = 0;
+  t0 = uptime();
+  runprog(argv);
+  t1 = uptime();
+  report(name, KB * NREP, "KB", t1 - t0);
+  unlink("bench.txt");
+}
+
+// cat a file to another file, and to a pipe. files are
+// limited to MAXFILE blocks, so repeat the copy to a file
+// and name the file repeatedly for the pipe.
+void
+catbench(char *name)
+{
+  enum { KB = 200, NREP = 16 };
+  char *argv[NREP + 2];
+  char buf[512];
+  int i, fd, p[2], n, sz, tot, xstatus, t0, t1;
+
+  sz = maketext("bench.txt", KB);
+  argv[0] = "cat";
+  argv[1] = "bench.txt";
+  argv[2] = 0;
+  t0 = uptime();
+  for(i = 0; i < NREP; i++){
+    if((fd = open("bench.out", O_CREATE|O_TRUNC|O_WRONLY)) < 0){
+      printf("%s: cannot create bench.out\n", name);
+      exit(1);
+    }
+    spawn(argv, fd);
+    close(fd);
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: cat failed\n", name);
+      exit(1);
+    }
+  }
+  t1 = uptime();
+  printf("%s ", name);
+  report("file", KB * NREP, "KB", t1 - t0);
+  unlink("bench.out");
+
+  for(i = 0; i < NREP; i++)
+    argv[1+i] = "bench.txt";
+  argv[1+NREP] = 0;
+  if(pipe(p) < 0){
+    printf("%s: pipe failed\n", name);
+    exit(1);
+  }
+  t0 = uptime();
+  spawn(argv, p[1]);
+  close(p[1]);
+  tot = 0;
+  while((n = read(p[0], buf, sizeof(buf))) > 0)
+    tot += n;
+  close(p[0]);
+  wait(&xstatus);
+  t1 = uptime();
+  if(xstatus != 0 || tot != NREP * sz){
+    printf("%s: cat to pipe failed\n", name);
+    exit(1);
+  }
+  printf("%s ", name);
+  report("pipe", KB * NREP, "KB", t1 - t0);
+  unlink("bench.txt");
+}
+
+// run a shell script of many short commands, which
+// is mostly fork, exec and path lookup.
+void
+scriptbench(char *name)
+{
+  enum { NCMD = 200 };
+  char *line = "echo hi > bench.out\n";
+  char *argv[] = { "sh", "bench.sh", 0 };
+  int i, fd, t0, t1;
+
+  if((fd = open("bench.sh", O_CREATE|O_TRUNC|O_WRONLY)) < 0){
+    printf("%s: cannot create bench.sh\n", name);
+    exit(1);
+  }
+  for(i = 0; i < NCMD; i++)
+    write(fd, line, strlen(line));
+  close(fd);
+
+  t0 = uptime();
+  runprog(argv);
+  t1 = uptime();
+  report(name, NCMD, "commands", t1 - t0);
+  unlink("bench.sh");
+  unlink("bench.out");
+}
+
+// null system call latency: getpid on the fast trap path,
+// and then on the full path, with the fast one turned off
+// through the statistics device.
+void
+syscallbench(char *name)
+{
+  enum { N = 100000 };
+  uint64 c0, c1, c2, c3;
+  int i, fd;
+
+  if((fd = open("statistics", O_WRONLY)) < 0){
+    mknod("statistics", STATS, 0);
+    fd = open("statistics", O_WRONLY);
+  }
+  c0 = rdcycle();
+  for(i = 0; i < N; i++)
+    getpid();
+  c1 = rdcycle();
+  // the same call, on the full path.
+  if(fd < 0 || write(fd, "sysfast 0", 9) != 9){
+    printf("%s: cannot turn off the fast path\n", name);
+    exit(1);
+  }
+  c2 = rdcycle();
+  for(i = 0; i < N; i++)
+    getpid();
+  c3 = rdcycle();
+  write(fd, "sysfast 1", 9);
+  close(fd);
+  printf("%s getpid, fast path: %d cycles/call\n", name, (int)((c1 - c0) / N));
+  printf("%s getpid, full path: %d cycles/call\n", name, (int)((c3 - c2) / N));
+}
+
+// context switch latency: two processes pass a byte
+// back and forth through a pair of pipes.
+void
+ctxswbench(char *name)
+{
+  enum { N = 10000 };
+  int i, p1[2], p2[2], pid, t0, t1;
+  uint64 c0, c1;
+  char c = 'x';
+
+  if(pipe(p1) < 0 || pipe(p2) < 0){
+    printf("%s: pipe failed\n", name);
+    exit(1);
+  }
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", name);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < N; i++){
+      if(read(p1[0], &c, 1) != 1 || write(p2[1], &c, 1) != 1)
+        exit(1);
+    }
+    exit(0);
+  }
+  t0 = uptime();
+  c0 = rdcycle();
+  for(i = 0; i < N; i++){
+    if(write(p1[1], &c, 1) != 1 || read(p2[0], &c, 1) != 1){
+      printf("%s: pingpong failed\n", name);
+      exit(1);
+    }
+  }
+  c1 = rdcycle();
+  t1 = uptime();
+  wait(0);
+  report(name, N, "round trips", t1 - t0);
+  printf("%s: %d cycles/round trip\n", name, (int)((c1 - c0) / N));
+}
+
+// page allocation latency: grow and shrink the heap with
+// sbrk(), which maps zeroed pages, and fork a process with
+// a heap, which copies it.
+void
+membench(char *name)
+{
+  enum { NPAGE = 256, NSBRK = 64, NFORK = 64 };
+  uint64 c0, c1, c2;
+  int i, pid;
+
+  c0 = rdcycle();
+  for(i = 0; i < NSBRK; i++){
+    if(sbrk(NPAGE * 4096) == (char*)-1){
+      printf("%s: sbrk failed\n", name);
+      exit(1);
+    }
+    sbrk(-NPAGE * 4096);
+  }
+  c1 = rdcycle();
+  sbrk(NPAGE * 4096);
+  for(i = 0; i < NFORK; i++){
+    if((pid = fork()) < 0){
+      printf("%s: fork failed\n", name);
+      exit(1);
+    }
+    if(pid == 0)
+      exit(0);
+    wait(0);
+  }
+  c2 = rdcycle();
+  printf("%s sbrk: %d cycles/page\n", name, (int)((c1 - c0) / (NSBRK * NPAGE)));
+  printf("%s fork: %d cycles/fork of %d pages\n", name, (int)((c2 - c1) / NFORK), NPAGE);
+}
+
+// the ring buffer for shmbench, in the first CHUNK of a shared
+// memory segment, followed by its RING slots of CHUNK bytes.
+struct ring {
+  int head;     // chunks written
+  int tail;     // chunks read
+  int hwait;    // the reader may be waiting on head
+  int twait;    // the writer may be waiting on tail
+};
+
+// wait until *p is no longer v: set *w, so that the other
+// side knows to call futexwake(p), and look again first.
+void
+ringwait(int *p, int v, int *w)
+{
+  while(*(volatile int *)p == v){
+    *(volatile int *)w = 1;
+    __sync_synchronize();
+    if(*(volatile int *)p == v)
+      futexwait(p, v);
+    *(volatile int *)w = 0;
+  }
+}
+
+// advance *p, and wake the other side if it's waiting.
+void
+ringpost(int *p, int *w)
+{
+  __sync_synchronize();
+  *(volatile int *)p += 1;
+  __sync_synchronize();
+  if(*(volatile int *)w)
+    futexwake(p);
+}
+
+// move data from one process to another through a pipe,
+// and through a ring buffer in a shared memory segment,
+// where the writer produces the data in place and the
+// reader uses it in place, with futexes for waiting.
+void
+shmbench(char *name)
+{
+  enum { MB = 16, CHUNK = 4096, RING = 16, N = MB * 1024 * 1024 / CHUNK };
+  static char buf[CHUNK];
+  struct ring *r;
+  char *slots;
+  int i, j, n, p[2], pid, xstatus, t0, t1;
+  uint sum, want;
+
+  // the data, and a checksum the reader computes.
+  want = 0;
+  for(i = 0; i < N; i++)
+    for(j = 0; j < CHUNK; j += 64)
+      want += i + j;
+
+  if(pipe(p) < 0){
+    printf("%s: pipe failed\n", name);
+    exit(1);
+  }
+  t0 = uptime();
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", name);
+    exit(1);
+  }
+  if(pid == 0){
+    close(p[0]);
+    for(i = 0; i < N; i++){
+      for(j = 0; j < CHUNK; j += 64)
+        *(uint *)(buf + j) = i + j;
+      if(write(p[1], buf, CHUNK) != CHUNK)
+        exit(1);
+    }
+    exit(0);
+  }
+  close(p[1]);
+  sum = 0;
+  for(i = 0; (n = read(p[0], buf + i, CHUNK - i)) > 0; ){
+    if((i += n) < CHUNK)
+      continue;
+    for(j = 0; j < CHUNK; j += 64)
+      sum += *(uint *)(buf + j);
+    i = 0;
+  }
+  close(p[0]);
+  wait(&xstatus);
+  t1 = uptime();
+  if(xstatus != 0 || sum != want){
+    printf("%s: pipe transfer failed\n", name);
+    exit(1);
+  }
+  printf("%s ", name);
+  report("pipe", MB * 1024, "KB", t1 - t0);
+
+  shmunlink("bench");
+  if((r = (struct ring *)shmmap("bench", (RING + 1) * CHUNK)) == (struct ring *)-1){
+    printf("%s: shmmap failed\n", name);
+    exit(1);
+  }
+  slots = (char *)r + CHUNK;
+  t0 = uptime();
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", name);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < N; i++){
+      ringwait(&r->tail, i - RING, &r->twait);
+      for(j = 0; j < CHUNK; j += 64)
+        *(uint *)(slots + (i % RING) * CHUNK + j) = i + j;
+      ringpost(&r->head, &r->hwait);
+    }
+    exit(0);
+  }
+  sum = 0;
+  for(i = 0; i < N; i++){
+    ringwait(&r->head, i, &r->hwait);
+    for(j = 0; j < CHUNK; j += 64)
+      sum += *(uint *)(slots + (i % RING) * CHUNK + j);
+    ringpost(&r->tail, &r->twait);
+  }
+  wait(&xstatus);
+  t1 = uptime();
+  shmunlink("bench");
+  if(xstatus != 0 || sum != want){
+    printf("%s: shm transfer failed\n", name);
+    exit(1);
+  }
+  printf("%s ", name);
+  report("shm", MB * 1024, "KB", t1 - t0);
+}
+
+// write a large file in big writes, over and over: the
+// file system's write bandwidth. the first pass allocates
+// the blocks; the others overwrite them in place.
+void
+writebench(char *name)
+{
+  enum { KB = 256, WSZ = 32 * 1024, NREP = 8 };
+  static char buf[WSZ];
+  int i, j, fd, t0, t1;
+
+  memset(buf, 'x', sizeof(buf));
+  unlink("bench.out");
+  t0 = uptime();
+  for(i = 0; i < NREP; i++){
+    if((fd = open("bench.out", O_CREATE|O_WRONLY)) < 0){
+      printf("%s: cannot create bench.out\n", name);
+      exit(1);
+    }
+    for(j = 0; j < KB * 1024 / WSZ; j++){
+      if(write(fd, buf, WSZ) != WSZ){
+        printf("%s: write failed\n", name);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+  t1 = uptime();
+  report(name, KB * NREP, "KB", t1 - t0);
+  unlink("bench.out");
+}
+
+// create, write and delete small files: each step is its
+// own transaction, so this measures commit latency.
+void
+createbench(char *name)
+{
+  enum { N = 200 };
+  char buf[64];
+  int i, fd, t0, t1;
+
+  memset(buf, 'x', sizeof(buf));
+  t0 = uptime();
+  for(i = 0; i < N; i++){
+    if((fd = open("bench.tmp", O_CREATE|O_WRONLY)) < 0){
+      printf("%s: cannot create bench.tmp\n", name);
+      exit(1);
+    }
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", name);
+      exit(1);
+    }
+    close(fd);
+    unlink("bench.tmp");
+  }
+  t1 = uptime();
+  report(name, N, "files", t1 - t0);
+}
+
+// NWRITER processes each append to their own file in small
+// writes, each its own FS system call: how many calls the
+// log lets run at once.
+void
+writersbench(char *name)
+{
+  enum { NWRITER = 16, N = 50, WSZ = 512 };
+  static char buf[WSZ];
+  char file[] = "bench.wX";
+  int i, j, fd, pid, xstatus, t0, t1;
+
+  memset(buf, 'x', sizeof(buf));
+  t0 = uptime();
+  for(i = 0; i < NWRITER; i++){
+    file[7] = 'a' + i;
+    if((pid = fork()) < 0){
+      printf("%s: fork failed\n", name);
+      exit(1);
+    }
+    if(pid == 0){
+      if((fd = open(file, O_CREATE|O_WRONLY)) < 0){
+        printf("%s: cannot create %s\n", name, file);
+        exit(1);
+      }
+      for(j = 0; j < N; j++){
+        if(write(fd, buf, WSZ) != WSZ){
+          printf("%s: write failed\n", name);
+          exit(1);
+        }
+      }
+      close(fd);
+      exit(0);
+    }
+  }
+  for(i = 0; i < NWRITER; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  t1 = uptime();
+  report(name, NWRITER * N, "writes", t1 - t0);
+  for(i = 0; i < NWRITER; i++){
+    file[7] = 'a' + i;
+    unlink(file);
+  }
+}
+
+// sequential against scattered disk writes. "seq" writes
+// a file of NBLK blocks in one write(), over and over, so
+// that each commit writes a run of neighbouring blocks that
+// the disk queue can merge. there is no lseek(), so "rand"
+// instead has NPROC processes at once each write a block at
+// a time to files chosen at random from its NFILE.
+void
+diskbench(char *name)
+{
+  enum { NBLK = 60, NREP = 8, NPROC = 4, NFILE = 16, NWRITE = NBLK * NREP / NPROC };
+  static char buf[NBLK * 1024];
+  char file[] = "bench.dXX";
+  int i, j, fd, pid, xstatus, t0, t1;
+  uint seed;
+
+  memset(buf, 'x', sizeof(buf));
+  unlink("bench.out");
+  t0 = uptime();
+  for(i = 0; i < NREP; i++){
+    if((fd = open("bench.out", O_CREATE|O_WRONLY)) < 0 ||
+       write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: cannot write bench.out\n", name);
+      exit(1);
+    }
+    close(fd);
+  }
+  t1 = uptime();
+  report("disk seq", NBLK * NREP, "blocks", t1 - t0);
+  unlink("bench.out");
+
+  t0 = uptime();
+  for(i = 0; i < NPROC; i++){
+    if((pid = fork()) < 0){
+      printf("%s: fork failed\n", name);
+      exit(1);
+    }
+    if(pid == 0){
+      seed = getpid();
+      file[7] = 'a' + i;
+      for(j = 0; j < NWRITE; j++){
+        seed = seed * 1103515245 + 12345;
+        file[8] = 'a' + (seed >> 16) % NFILE;
+        if((fd = open(file, O_CREATE|O_WRONLY)) < 0 ||
+           write(fd, buf, 1024) != 1024){
+          printf("%s: cannot write %s\n", name, file);
+          exit(1);
+        }
+        close(fd);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < NPROC; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  t1 = uptime();
+  report("disk rand", NPROC * NWRITE, "blocks", t1 - t0);
+  for(i = 0; i < NPROC; i++){
+    file[7] = 'a' + i;
+    for(j = 0; j < NFILE; j++){
+      file[8] = 'a' + j;
+      unlink(file);
+    }
+  }
+}
+
+struct bench {
+  void (*f)(char *);
+  char *s;
+} benches[] = {
+  {consolebench, "console"},
+  {grepbench, "grep"},
+  {wcbench, "wc"},
+  {catbench, "cat"},
+  {scriptbench, "script"},
+  {syscallbench, "syscall"},
+  {ctxswbench, "ctxsw"},
+  {shmbench, "shm"},
+  {membench, "mem"},
+  {writebench, "write"},
+  {createbench, "create"},
+  {writersbench, "writers"},
+  {diskbench, "disk"},
+  { 0, 0},
+};
+
+// run each benchmark in its own process.
+void
+run(void f(char *), char *s)
+{
+  int pid, xstatus;
+
+  if((pid = fork()) < 0){
+    printf("bench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    f(s);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    printf("%s: FAILED\n", s);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct bench *b;
+  int i, found;
+
+  if(argc <= 1){
+    for(b = benches; b->s != 0; b++)
+      run(b->f, b->s);
+    exit(0);
+  }
+
+  for(i = 1; i < argc; i++){
+    found = 0;
+    for(b = benches; b->s != 0; b++){
+      if(strcmp(b->s, argv[i]) == 0){
+        run(b->f, b->s);
+        found = 1;
+      }
+    }
+    if(!found){
+      fprintf(2, "bench: unknown benchmark %s\n", argv[i]);
+      exit(1);
+    }
+  }
+  exit(0);
+}
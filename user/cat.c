@@ -2,13 +2,23 @@
 #include "kernel/fcntl.h"
 #include "user/user.h"
 
-char buf[512];
+// page-aligned, so each read() and write() touches
+// as few pages as possible.
+char buf[8192] __attribute__((aligned(4096)));
 
 void
 cat(int fd)
 {
   int n;
 
+  // let the kernel copy straight from fd to the output.
+  // sendfile() fails if fd isn't a file, and then
+  // cat falls back to read() and write().
+  while((n = sendfile(1, fd, sizeof(buf))) > 0)
+    ;
+  if(n == 0)
+    return;
+
   while((n = read(fd, buf, sizeof(buf))) > 0) {
     if (write(1, buf, n) != n) {
       fprintf(2, "cat: write error\n");
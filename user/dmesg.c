@@ -0,0 +1,23 @@
+// print the kernel log.
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  char *buf;
+  int n;
+
+  if((buf = malloc(KLOGSIZE)) == 0){
+    fprintf(2, "dmesg: out of memory\n");
+    exit(1);
+  }
+  if((n = dmesg(buf, KLOGSIZE)) < 0){
+    fprintf(2, "dmesg: failed\n");
+    exit(1);
+  }
+  write(1, buf, n);
+  exit(0);
+}
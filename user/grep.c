@@ -1,64 +1,336 @@
 // Simple grep.  Only supports ^ . * $ operators.
+//
+// grep [-c] [-l] [-v] pattern [file ...]
+//   -c  print only a count of selected lines
+//   -l  print only the names of files with selected lines
+//   -v  select lines that don't match
+//
+// The pattern is compiled into a bit-parallel NFA, so that
+// each input byte costs a few word operations rather than a
+// backtracking search. A pattern with no operators is found
+// with Boyer-Moore-Horspool, which skips most of the input
+// without looking at it.
 
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
 #include "user/user.h"
 
-char buf[1024];
+#define BUFSZ 16384
+#define OUTSZ 4096
+
+char buf[BUFSZ];
+
+int cflag, lflag, vflag;
+char *pattern;
+
 int match(char*, char*);
 
+// the pattern as an NFA with one state per position in
+// the pattern: state i means the first i items have matched.
+// a set of states is a bit mask.
+struct {
+  int bol;          // pattern starts with ^
+  int eol;          // pattern ends with $
+  uint64 star;      // bit i: item i is followed by *
+  uint64 start;     // states active before any input
+  uint64 accept;    // the state after the last item
+  uint64 adv[256];  // bit i+1: plain item i matches the byte
+  uint64 loop[256]; // bit i: starred item i matches the byte
+} re;
+
+// is the pattern a plain string? then use skip[], below.
+int literal;
+int litlen;
+int skip[256];
+
+// fall back to the recursive matcher for patterns with
+// more items than fit in a mask.
+int slow;
+
+// buffered output, so that selecting many lines
+// doesn't cost a write() each.
+char out[OUTSZ];
+int nout;
+
+void
+flush(void)
+{
+  if(nout > 0)
+    write(1, out, nout);
+  nout = 0;
+}
+
+void
+emit(char *p, int n)
+{
+  if(nout + n > OUTSZ){
+    flush();
+    if(n > OUTSZ){
+      write(1, p, n);
+      return;
+    }
+  }
+  memmove(out + nout, p, n);
+  nout += n;
+}
+
+// add the states reachable by skipping starred items.
+uint64
+closure(uint64 d)
+{
+  uint64 x;
+
+  while((x = d | ((d & re.star) << 1)) != d)
+    d = x;
+  return d;
+}
+
 void
-grep(char *pattern, int fd)
+compile(char *p)
 {
-  int n, m;
-  char *p, *q;
+  int i, n, c;
+  uint64 bit;
 
+  literal = 1;
+  for(i = 0; p[i]; i++)
+    if(p[i] == '^' || p[i] == '.' || p[i] == '*' || p[i] == '$')
+      literal = 0;
+  litlen = i;
+  if(literal && litlen > 0){
+    // Boyer-Moore-Horspool shift table.
+    for(c = 0; c < 256; c++)
+      skip[c] = litlen;
+    for(i = 0; i < litlen - 1; i++)
+      skip[(uchar)p[i]] = litlen - 1 - i;
+    return;
+  }
+  literal = 0;
+
+  if(*p == '^'){
+    re.bol = 1;
+    p++;
+  }
+  for(n = 0; *p; n++){
+    if(n >= 63){
+      slow = 1;
+      return;
+    }
+    bit = (uint64)1 << n;
+    if(p[0] == '$' && p[1] == '\0'){
+      re.eol = 1;
+      break;
+    }
+    if(p[1] == '*')
+      re.star |= bit;
+    for(c = 0; c < 256; c++){
+      if(p[0] != '.' && p[0] != c)
+        continue;
+      if(p[1] == '*')
+        re.loop[c] |= bit;
+      else
+        re.adv[c] |= bit << 1;
+    }
+    p += (p[1] == '*') ? 2 : 1;
+  }
+  re.accept = (uint64)1 << n;
+  re.start = closure(1);
+}
+
+// does the line [s, e) match the compiled pattern?
+int
+nfamatch(char *s, char *e)
+{
+  uint64 d;
+  int c;
+
+  d = re.start;
+  for(; s < e; s++){
+    if((d & re.accept) && !re.eol)
+      return 1;
+    c = (uchar)*s;
+    d = ((d << 1) & re.adv[c]) | (d & re.loop[c]);
+    d = closure(d);
+    if(!re.bol)
+      d |= re.start;
+    else if(d == 0)
+      return 0;
+  }
+  return (d & re.accept) != 0;
+}
+
+// find the pattern string in [s, e), or return 0.
+char*
+bmh(char *s, char *e)
+{
+  int last = litlen - 1;
+  uchar c;
+
+  while(e - s >= litlen){
+    c = s[last];
+    if(c == pattern[last] && memcmp(s, pattern, last) == 0)
+      return s;
+    s += skip[c];
+  }
+  return 0;
+}
+
+char*
+findnl(char *s, char *e)
+{
+  for(; s < e; s++)
+    if(*s == '\n')
+      return s;
+  return 0;
+}
+
+// does the line [s, e) match? e points at a
+// writable byte just past the line (its newline).
+int
+linematch(char *s, char *e)
+{
+  int r;
+  char c;
+
+  if(literal)
+    return bmh(s, e) != 0;
+  if(!slow)
+    return nfamatch(s, e);
+  c = *e;
+  *e = '\0';
+  r = match(pattern, s);
+  *e = c;
+  return r;
+}
+
+// process the complete lines in [s, e), each of which
+// ends with a newline. returns the number selected, or
+// -1 if -l is done with this file.
+int
+lines(char *s, char *e)
+{
+  char *q, *m, *ls;
+  int n;
+
+  n = 0;
+  if(literal && !vflag){
+    // skip straight to each occurrence of the pattern.
+    while((m = bmh(s, e)) != 0){
+      for(ls = m; ls > s && ls[-1] != '\n'; ls--)
+        ;
+      q = findnl(m, e);
+      n++;
+      if(lflag)
+        return -1;
+      if(!cflag)
+        emit(ls, q+1 - ls);
+      s = q+1;
+    }
+    return n;
+  }
+
+  while(s < e){
+    q = findnl(s, e);
+    if(linematch(s, q) != vflag){
+      n++;
+      if(lflag)
+        return -1;
+      if(!cflag)
+        emit(s, q+1 - s);
+    }
+    s = q+1;
+  }
+  return n;
+}
+
+void
+grep(int fd, char *name, int many)
+{
+  int n, m, count, r;
+  char *p;
+
+  count = 0;
   m = 0;
   while((n = read(fd, buf+m, sizeof(buf)-m-1)) > 0){
     m += n;
-    buf[m] = '\0';
-    p = buf;
-    while((q = strchr(p, '\n')) != 0){
-      *q = 0;
-      if(match(pattern, p)){
-        *q = '\n';
-        write(1, p, q+1 - p);
-      }
-      p = q+1;
-    }
-    if(m > 0){
-      m -= p - buf;
-      memmove(buf, p, m);
+    // find the end of the last complete line.
+    for(p = buf+m; p > buf && p[-1] != '\n'; p--)
+      ;
+    if(p == buf && m == sizeof(buf)-1){
+      // a line longer than buf; treat what we have as a line.
+      buf[m++] = '\n';
+      p = buf+m;
     }
+    if((r = lines(buf, p)) < 0)
+      goto found;
+    count += r;
+    m -= p - buf;
+    memmove(buf, p, m);
+  }
+  if(m > 0){
+    // a last line without a newline.
+    buf[m++] = '\n';
+    if((r = lines(buf, buf+m)) < 0)
+      goto found;
+    count += r;
   }
+
+  if(cflag){
+    if(many)
+      printf("%s:%d\n", name, count);
+    else
+      printf("%d\n", count);
+  }
+  return;
+
+found:
+  // -l, and this file has a selected line.
+  printf("%s\n", name);
 }
 
 int
 main(int argc, char *argv[])
 {
-  int fd, i;
-  char *pattern;
+  int fd, i, many;
 
-  if(argc <= 1){
-    fprintf(2, "usage: grep pattern [file ...]\n");
+  for(i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++){
+    for(char *f = argv[i]+1; *f; f++){
+      if(*f == 'c')
+        cflag = 1;
+      else if(*f == 'l')
+        lflag = 1;
+      else if(*f == 'v')
+        vflag = 1;
+      else {
+        fprintf(2, "grep: unknown flag -%c\n", *f);
+        exit(1);
+      }
+    }
+  }
+  if(i >= argc){
+    fprintf(2, "usage: grep [-c] [-l] [-v] pattern [file ...]\n");
     exit(1);
   }
-  pattern = argv[1];
+  pattern = argv[i++];
+  compile(pattern);
 
-  if(argc <= 2){
-    grep(pattern, 0);
+  if(i >= argc){
+    grep(0, "(standard input)", 0);
+    flush();
     exit(0);
   }
 
-  for(i = 2; i < argc; i++){
+  many = argc - i > 1;
+  for(; i < argc; i++){
     if((fd = open(argv[i], O_RDONLY)) < 0){
+      flush();
       printf("grep: cannot open %s\n", argv[i]);
       exit(1);
     }
-    grep(pattern, fd);
+    grep(fd, argv[i], many);
     close(fd);
   }
+  flush();
   exit(0);
 }
 
@@ -104,4 +376,3 @@ int matchstar(int c, char *re, char *text)
   }while(*text!='\0' && (*text++==c || c=='.'));
   return 0;
 }
-
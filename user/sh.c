@@ -12,6 +12,7 @@
 #define BACK  5
 
 #define MAXARGS 10
+#define MAXSTAGES 16
 
 struct cmd {
   int type;
@@ -53,12 +54,14 @@ int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
 void runcmd(struct cmd*) __attribute__((noreturn));
+void runpipe(struct pipecmd*) __attribute__((noreturn));
+
+int timing;  // report per-stage times (the time builtin)
 
 // Execute cmd.  Never returns.
 void
 runcmd(struct cmd *cmd)
 {
-  int p[2];
   struct backcmd *bcmd;
   struct execcmd *ecmd;
   struct listcmd *lcmd;
@@ -100,26 +103,7 @@ runcmd(struct cmd *cmd)
 
   case PIPE:
     pcmd = (struct pipecmd*)cmd;
-    if(pipe(p) < 0)
-      panic("pipe");
-    if(fork1() == 0){
-      close(1);
-      dup(p[1]);
-      close(p[0]);
-      close(p[1]);
-      runcmd(pcmd->left);
-    }
-    if(fork1() == 0){
-      close(0);
-      dup(p[0]);
-      close(p[0]);
-      close(p[1]);
-      runcmd(pcmd->right);
-    }
-    close(p[0]);
-    close(p[1]);
-    wait(0);
-    wait(0);
+    runpipe(pcmd);
     break;
 
   case BACK:
@@ -131,22 +115,142 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// the program a pipeline stage runs, for the time builtin.
+char*
+cmdname(struct cmd *cmd)
+{
+  while(cmd->type == REDIR)
+    cmd = ((struct redircmd*)cmd)->cmd;
+  if(cmd->type == EXEC && ((struct execcmd*)cmd)->argv[0])
+    return ((struct execcmd*)cmd)->argv[0];
+  return "(...)";
+}
+
+// Run the pipeline a | b | c ... by forking every stage
+// from this process, rather than forking a subshell for
+// each | as the parse tree nests.  A pipeline longer than
+// MAXSTAGES runs its tail as one last stage, which is a
+// pipeline in turn.  Never returns.
+void
+runpipe(struct pipecmd *pcmd)
+{
+  struct cmd *c, *stage[MAXSTAGES];
+  int i, n, p[2], in, pid[MAXSTAGES], end[MAXSTAGES], t0, w;
+
+  n = 0;
+  c = (struct cmd*)pcmd;
+  for(; c->type == PIPE && n < MAXSTAGES-1; c = ((struct pipecmd*)c)->right)
+    stage[n++] = ((struct pipecmd*)c)->left;
+  stage[n++] = c;
+
+  t0 = uptime();
+  in = -1;
+  for(i = 0; i < n; i++){
+    if(i < n-1 && pipe(p) < 0)
+      panic("pipe");
+    if((pid[i] = fork1()) == 0){
+      if(in >= 0){
+        close(0);
+        dup(in);
+        close(in);
+      }
+      if(i < n-1){
+        close(1);
+        dup(p[1]);
+        close(p[0]);
+        close(p[1]);
+      }
+      runcmd(stage[i]);
+    }
+    if(in >= 0)
+      close(in);
+    if(i < n-1){
+      close(p[1]);
+      in = p[0];
+    }
+  }
+
+  for(i = 0; i < n; i++){
+    if((w = wait(0)) < 0)
+      break;
+    for(int j = 0; j < n; j++)
+      if(pid[j] == w)
+        end[j] = uptime();
+  }
+  if(timing)
+    for(i = 0; i < n; i++)
+      fprintf(2, "  %d %s: %d ticks\n", i+1, cmdname(stage[i]), end[i] - t0);
+  exit(0);
+}
+
+// read commands from infd. a script named on the
+// command line is run without prompts.
+int infd = 0;
+int interactive = 1;
+
+// a script is read a buffer at a time, which is safe since
+// no other process reads infd: commands are run with it
+// closed. standard input is read a byte at a time, by
+// fgets(), so that what follows a command is left for it.
+struct {
+  int r;
+  int n;
+  char buf[512];
+} script;
+
+void
+scriptgets(char *buf, int max)
+{
+  int i;
+  char c;
+
+  for(i = 0; i+1 < max; ){
+    if(script.r == script.n){
+      script.r = 0;
+      script.n = read(infd, script.buf, sizeof(script.buf));
+      if(script.n < 1){
+        script.n = 0;
+        break;
+      }
+    }
+    c = script.buf[script.r++];
+    buf[i++] = c;
+    if(c == '\n' || c == '\r')
+      break;
+  }
+  buf[i] = '\0';
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
-  write(2, "$ ", 2);
+  if(interactive)
+    write(2, "$ ", 2);
   memset(buf, 0, nbuf);
-  gets(buf, nbuf);
+  if(infd != 0)
+    scriptgets(buf, nbuf);
+  else
+    fgets(0, buf, nbuf);
   if(buf[0] == 0) // EOF
     return -1;
   return 0;
 }
 
+// run a command line in a child of the shell, which
+// has no need of the script.
+void
+runline(char *buf)
+{
+  if(infd != 0)
+    close(infd);
+  runcmd(parsecmd(buf));
+}
+
 int
-main(void)
+main(int argc, char *argv[])
 {
   static char buf[100];
-  int fd;
+  int fd, t0;
 
   // Ensure that three file descriptors are open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -156,6 +260,15 @@ main(void)
     }
   }
 
+  // sh script: run the commands in script.
+  if(argc > 1){
+    if((infd = open(argv[1], O_RDONLY)) < 0){
+      fprintf(2, "sh: cannot open %s\n", argv[1]);
+      exit(1);
+    }
+    interactive = 0;
+  }
+
   // Read and run input commands.
   while(getcmd(buf, sizeof(buf)) >= 0){
     if(buf[0] == 'c' && buf[1] == 'd' && buf[2] == ' '){
@@ -165,8 +278,19 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
+    if(memcmp(buf, "time ", 5) == 0){
+      // Time the rest of the line, and each stage of a pipeline.
+      timing = 1;
+      t0 = uptime();
+      if(fork1() == 0)
+        runline(buf+5);
+      wait(0);
+      fprintf(2, "real %d ticks\n", uptime() - t0);
+      timing = 0;
+      continue;
+    }
     if(fork1() == 0)
-      runcmd(parsecmd(buf));
+      runline(buf);
     wait(0);
   }
   exit(0);
@@ -0,0 +1,50 @@
+// print the kernel's statistics.
+// stats name value -- change a setting, e.g. stats ksm 1
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/fs.h"
+#include "kernel/file.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+
+int
+main(int argc, char *argv[])
+{
+  char buf[512];
+  int fd, n;
+
+  if(argc != 1 && argc != 3){
+    fprintf(2, "usage: stats [name value]\n");
+    exit(1);
+  }
+  if((fd = open("statistics", O_RDWR)) < 0){
+    mknod("statistics", STATS, 0);
+    fd = open("statistics", O_RDWR);
+  }
+  if(fd < 0){
+    fprintf(2, "stats: cannot open statistics\n");
+    exit(1);
+  }
+  if(argc == 3){
+    n = strlen(argv[1]) + 1 + strlen(argv[2]);
+    if(n >= sizeof(buf)){
+      fprintf(2, "stats: setting too long\n");
+      exit(1);
+    }
+    strcpy(buf, argv[1]);
+    buf[strlen(argv[1])] = ' ';
+    strcpy(buf + strlen(argv[1]) + 1, argv[2]);
+    if(write(fd, buf, n) != n){
+      fprintf(2, "stats: cannot set %s\n", argv[1]);
+      exit(1);
+    }
+    exit(0);
+  }
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    write(1, buf, n);
+  close(fd);
+  exit(0);
+}
@@ -63,14 +63,17 @@ strchr(const char *s, char c)
   return 0;
 }
 
+// read a line from fd, a byte at a time, so that nothing
+// past the newline is taken from the fd: a child reading
+// the same fd, or a command the shell runs, sees the rest.
 char*
-gets(char *buf, int max)
+fgets(int fd, char *buf, int max)
 {
   int i, cc;
   char c;
 
   for(i=0; i+1 < max; ){
-    cc = read(0, &c, 1);
+    cc = read(fd, &c, 1);
     if(cc < 1)
       break;
     buf[i++] = c;
@@ -81,6 +84,12 @@ gets(char *buf, int max)
   return buf;
 }
 
+char*
+gets(char *buf, int max)
+{
+  return fgets(0, buf, max);
+}
+
 int
 stat(const char *n, struct stat *st)
 {
@@ -22,6 +22,12 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int dmesg(char*, int);
+int sendfile(int, int, int);
+char* shmmap(char*, int);
+int shmunlink(char*);
+int futexwait(int*, int);
+int futexwake(int*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -32,6 +38,7 @@ int strcmp(const char*, const char*);
 void fprintf(int, const char*, ...) __attribute__ ((format (printf, 2, 3)));
 void printf(const char*, ...) __attribute__ ((format (printf, 1, 2)));
 char* gets(char*, int max);
+char* fgets(int, char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
 int atoi(const char*);
@@ -3,6 +3,9 @@
 #include "kernel/stat.h"
 #include "user/user.h"
 #include "kernel/fs.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/file.h"
 #include "kernel/fcntl.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
@@ -2586,6 +2589,189 @@ badarg(char *s)
   exit(0);
 }
 
+// memory from sbrk() should be zeroes, even when it
+// reuses pages just freed with other contents.
+void
+sbrkzero(char *s)
+{
+  enum { SZ = 64*4096 };
+  char *a;
+  int i, j;
+
+  for(i = 0; i < 8; i++){
+    a = sbrk(SZ);
+    if(a == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < SZ; j++){
+      if(a[j] != 0){
+        printf("%s: non-zero byte at %p\n", s, a + j);
+        exit(1);
+      }
+    }
+    memset(a, 0xa5, SZ);
+    sbrk(-SZ);
+  }
+}
+
+// a shared memory segment should be shared with a forked
+// child, and with a process that maps it by name, and a
+// futex should wake a process waiting on a word in it.
+void
+shmtest(char *s)
+{
+  int *a, *b, pid, xstatus;
+
+  shmunlink("shmtest");
+  if((a = (int*)shmmap("shmtest", 2*4096)) == (int*)-1){
+    printf("%s: shmmap failed\n", s);
+    exit(1);
+  }
+  if(shmmap("shmtest", 3*4096) != (char*)-1){
+    printf("%s: shmmap bigger than the segment succeeded\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // a second mapping, of the same pages.
+    if((b = (int*)shmmap("shmtest", 4096)) == (int*)-1)
+      exit(1);
+    while(a[1] == 0)
+      futexwait(&a[1], 0);
+    b[1024] = a[1] + 1;
+    b[0] = 1;
+    futexwake(&a[0]);
+    exit(0);
+  }
+  a[1] = 42;
+  futexwake(&a[1]);
+  while(a[0] == 0)
+    futexwait(&a[0], 0);
+  if(a[1024] != 43){
+    printf("%s: wrong value %d\n", s, a[1024]);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  if(shmunlink("shmtest") != 0 || shmunlink("shmtest") != -1){
+    printf("%s: shmunlink failed\n", s);
+    exit(1);
+  }
+  // still mapped after the name is gone.
+  if(a[1024] != 43)
+    exit(1);
+  if(futexwait(&a[1], 0) != 0 || futexwait((int*)((char*)a + 1), 0) != -1){
+    printf("%s: futexwait failed\n", s);
+    exit(1);
+  }
+}
+
+// the file table grows as needed: more files than the
+// fixed table used to hold (100) can be open at once.
+void
+manyfiles(char *s)
+{
+  enum { NCHILD = 12, NPIPE = 5 };
+  int i, j, pid, xstatus, go[2], ready[2], fds[2];
+  char c;
+
+  if(pipe(go) < 0 || pipe(ready) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(go[1]);
+      close(ready[0]);
+      for(j = 0; j < NPIPE; j++){
+        if(pipe(fds) < 0){
+          printf("%s: pipe %d in child %d failed\n", s, j, i);
+          write(ready[1], "x", 1);
+          exit(1);
+        }
+      }
+      write(ready[1], "x", 1);
+      // keep them open until every child has its own.
+      read(go[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(ready[1]);
+  for(i = 0; i < NCHILD; i++)
+    if(read(ready[0], &c, 1) != 1)
+      break;
+  close(go[1]);
+  close(go[0]);
+  close(ready[0]);
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+}
+
+// read a report from the statistics device, and return
+// the number that follows key in it, or -1.
+int
+statsnum(int fd, char *key)
+{
+  static char buf[2048];
+  int n, tot;
+  char *p;
+
+  tot = 0;
+  while((n = read(fd, buf + tot, sizeof(buf) - 1 - tot)) > 0)
+    tot += n;
+  buf[tot] = '\0';
+  n = strlen(key);
+  for(p = buf; *p; p++)
+    if(memcmp(p, key, n) == 0)
+      return atoi(p + n);
+  return -1;
+}
+
+// shrinking memory should free the page-table pages that
+// mapped it, as well as the pages.
+void
+sbrkpt(char *s)
+{
+  enum { SZ = 32*1024*1024 };
+  int fd, before, after;
+
+  if((fd = open("statistics", O_RDONLY)) < 0){
+    mknod("statistics", STATS, 0);
+    fd = open("statistics", O_RDONLY);
+  }
+  if(fd < 0){
+    printf("%s: cannot open statistics\n", s);
+    exit(1);
+  }
+  before = statsnum(fd, "mem: ");
+  if(sbrk(SZ) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  sbrk(-SZ);
+  after = statsnum(fd, "mem: ");
+  close(fd);
+  // 32MB takes 16 page-table pages.
+  if(after < before - 4){
+    printf("%s: %d pages lost\n", s, before - after);
+    exit(1);
+  }
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2650,6 +2836,10 @@ struct test {
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
+  {shmtest, "shmtest"},
+  {sbrkzero, "sbrkzero"},
+  {manyfiles, "manyfiles"},
+  {sbrkpt, "sbrkpt"},
 
   { 0, 0},
 };
@@ -2939,6 +3129,269 @@ outofinodes(char *s)
   }
 }
 
+// use twice as much memory as the machine has, in several
+// processes, so that much of it has to be swapped out and
+// read back in. pages that are mostly zeroes compress well,
+// and stay in memory; pages of random data go to the disk.
+void
+swapwork(char *s, int random)
+{
+  enum { NCHILD = 4, SZ = 64*1024*1024, CHUNK = 1024*1024 };
+  int i, pid, xstatus;
+  uint64 j, k, w, x, *p;
+  char *a;
+
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      a = sbrk(0);
+      for(j = 0; j < SZ; j += CHUNK){
+        if(sbrk(CHUNK) == (char*)0xffffffffffffffffL){
+          printf("%s: sbrk failed after %d MB\n", s, (int)(j / CHUNK));
+          exit(1);
+        }
+        for(k = j; k < j + CHUNK; k += PGSIZE){
+          p = (uint64*)(a + k);
+          p[0] = i * SZ + k;
+          for(w = 1, x = p[0]; random && w < PGSIZE/sizeof(uint64); w++)
+            p[w] = x = x * 6364136223846793005UL + 1442695040888963407UL;
+        }
+      }
+      for(j = 0; j < SZ; j += PGSIZE){
+        p = (uint64*)(a + j);
+        if(p[0] != i * SZ + j){
+          printf("%s: wrong value at %p\n", s, p);
+          exit(1);
+        }
+        for(w = 1, x = p[0]; random && w < PGSIZE/sizeof(uint64); w++){
+          x = x * 6364136223846793005UL + 1442695040888963407UL;
+          if(p[w] != x){
+            printf("%s: wrong value at %p\n", s, p + w);
+            exit(1);
+          }
+        }
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+}
+
+void
+swaptest(char *s)
+{
+  swapwork(s, 0);
+}
+
+void
+swapdisk(char *s)
+{
+  swapwork(s, 1);
+}
+
+// the number of pages that page merging has saved.
+int
+ksmsaved(int fd)
+{
+  return statsnum(fd, "users, ");
+}
+
+// children with the same pages should come to share
+// them, and each still see its own values after writing
+// them. turning merging off should unshare them all.
+// the children spin rather than block while they wait,
+// since ksmd only takes pages from a process preempted in
+// user space, or waiting at some other safe point.
+void
+ksmtest(char *s)
+{
+  enum { NCHILD = 4, NPAGE = 256 };
+  int i, k, fd, pid, t0, xstatus;
+  volatile int *go;
+  uint64 *p;
+  char *a;
+
+  if((fd = open("statistics", O_RDWR)) < 0){
+    mknod("statistics", STATS, 0);
+    fd = open("statistics", O_RDWR);
+  }
+  if(fd < 0){
+    printf("%s: cannot open statistics\n", s);
+    exit(1);
+  }
+  shmunlink("ksmtest");
+  if((go = (int*)shmmap("ksmtest", PGSIZE)) == (int*)-1){
+    printf("%s: shmmap failed\n", s);
+    exit(1);
+  }
+  *go = 0;
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      a = sbrk(NPAGE * PGSIZE);
+      if(a == (char*)0xffffffffffffffffL){
+        printf("%s: sbrk failed\n", s);
+        exit(1);
+      }
+      // half the pages are zeroes.
+      for(k = 1; k < NPAGE; k += 2)
+        ((uint64*)(a + k*PGSIZE))[0] = k;
+      while(*go == 0)
+        ;
+      for(k = 0; k < NPAGE; k++){
+        p = (uint64*)(a + k*PGSIZE);
+        if(p[0] != (k % 2 ? k : 0)){
+          printf("%s: wrong value at %p\n", s, p);
+          exit(1);
+        }
+        p[1] = i;
+      }
+      for(k = 0; k < NPAGE; k++){
+        p = (uint64*)(a + k*PGSIZE);
+        if(p[0] != (k % 2 ? k : 0) || p[1] != i){
+          printf("%s: wrong value after write at %p\n", s, p);
+          exit(1);
+        }
+      }
+      exit(0);
+    }
+  }
+  if(write(fd, "ksm 1", 5) != 5){
+    printf("%s: cannot turn merging on\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  while(ksmsaved(fd) < (NCHILD-1) * NPAGE){
+    if(uptime() - t0 > 300){
+      printf("%s: pages not merged; %d saved\n", s, ksmsaved(fd));
+      *go = 1;
+      write(fd, "ksm 0", 5);
+      exit(1);
+    }
+    sleep(1);
+  }
+
+  *go = 1;
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      write(fd, "ksm 0", 5);
+      exit(1);
+    }
+  }
+
+  if(write(fd, "ksm 0", 5) != 5){
+    printf("%s: cannot turn merging off\n", s);
+    exit(1);
+  }
+  if((k = ksmsaved(fd)) != 0){
+    printf("%s: %d pages still shared\n", s, k);
+    exit(1);
+  }
+  close(fd);
+  shmunlink("ksmtest");
+}
+
+// a process that takes all of memory, having paged itself
+// out until swap space ran out too, should be killed when
+// sh needs memory to fork, rather than sh's fork failing.
+void
+oomtest(char *s)
+{
+  int fd, pid, shpid, kills, xstatus, ready[2], in[2];
+  char *argv[] = { "sh", 0 };
+  char c, buf[8];
+
+  if((fd = open("statistics", O_RDONLY)) < 0){
+    mknod("statistics", STATS, 0);
+    fd = open("statistics", O_RDONLY);
+  }
+  if(fd < 0){
+    printf("%s: cannot open statistics\n", s);
+    exit(1);
+  }
+  kills = statsnum(fd, "oom: ");
+  close(fd);
+  if(pipe(ready) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(ready[0]);
+    while(sbrk(1024*1024) != (char*)0xffffffffffffffffL)
+      ;
+    while(sbrk(PGSIZE) != (char*)0xffffffffffffffffL)
+      ;
+    write(ready[1], "x", 1);
+    for(;;)
+      ;
+  }
+  close(ready[1]);
+  if(read(ready[0], &c, 1) != 1){
+    printf("%s: runaway allocator died early\n", s);
+    exit(1);
+  }
+  close(ready[0]);
+
+  // sh, with a command on its input.
+  unlink("oomout");
+  if(pipe(in) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  write(in[1], "echo hi > oomout\n", 17);
+  close(in[1]);
+  shpid = fork();
+  if(shpid < 0){
+    printf("%s: fork of sh failed\n", s);
+    exit(1);
+  }
+  if(shpid == 0){
+    close(0);
+    dup(in[0]);
+    close(in[0]);
+    exec("sh", argv);
+    exit(1);
+  }
+  close(in[0]);
+  if(wait(&xstatus) != shpid || xstatus != 0){
+    printf("%s: sh failed\n", s);
+    exit(1);
+  }
+  kill(pid);
+  wait(0);
+
+  if((fd = open("oomout", O_RDONLY)) < 0 || read(fd, buf, sizeof(buf)) != 3 ||
+     memcmp(buf, "hi\n", 3) != 0){
+    printf("%s: sh's command didn't run\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("oomout");
+  if((fd = open("statistics", O_RDONLY)) < 0 || statsnum(fd, "oom: ") <= kills){
+    printf("%s: nothing was killed\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
 struct test slowtests[] = {
   {bigdir, "bigdir"},
   {manywrites, "manywrites"},
@@ -2946,6 +3399,10 @@ struct test slowtests[] = {
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
+  {swaptest, "swaptest"},
+  {swapdisk, "swapdisk"},
+  {ksmtest, "ksmtest"},
+  {oomtest, "oomtest"},
     
   { 0, 0},
 };
@@ -36,3 +36,9 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("dmesg");
+entry("sendfile");
+entry("shmmap");
+entry("shmunlink");
+entry("futexwait");
+entry("futexwake");
@@ -3,53 +3,171 @@
 #include "kernel/fcntl.h"
 #include "user/user.h"
 
-char buf[512];
+// count files in up to this many child processes at once.
+#define NPAR 4
 
+#define ONES  0x0101010101010101UL
+#define HIGHS (ONES * 0x80)
+#define LOWS  (ONES * 0x7f)
+
+uint64 buf[4096];  // aligned, so it can be scanned a word at a time
+char space[256];
+
+struct count {
+  int l, w, c;
+  int err;
+};
+
+// the high bit of each byte of x that equals c.
+uint64
+eqbytes(uint64 x, int c)
+{
+  uint64 t = x ^ (ONES * c);
+  return ~(((t & LOWS) + LOWS) | t) & HIGHS;
+}
+
+// the number of high bits set in a mask from eqbytes.
+int
+nbytes(uint64 m)
+{
+  return ((m >> 7) * ONES) >> 56;
+}
+
+// count eight bytes at a time: find the whitespace bytes
+// of each word, and count a word start wherever a
+// non-space byte follows a space.
 void
-wc(int fd, char *name)
+count(int fd, struct count *k)
 {
-  int i, n;
-  int l, w, c, inword;
+  int i, n, nw, inspace;
+  uint64 x, sp, starts;
+  char *p;
 
-  l = w = c = 0;
-  inword = 0;
+  memset(k, 0, sizeof(*k));
+  inspace = 1;
   while((n = read(fd, buf, sizeof(buf))) > 0){
-    for(i=0; i<n; i++){
-      c++;
-      if(buf[i] == '\n')
-        l++;
-      if(strchr(" \r\t\n\v", buf[i]))
-        inword = 0;
-      else if(!inword){
-        w++;
-        inword = 1;
-      }
+    k->c += n;
+    nw = n / 8;
+    for(i = 0; i < nw; i++){
+      x = buf[i];
+      sp = eqbytes(x, ' ') | eqbytes(x, '\t') | eqbytes(x, '\n') |
+           eqbytes(x, '\v') | eqbytes(x, '\r');
+      starts = ~sp & HIGHS & ((sp << 8) | (inspace ? 0x80 : 0));
+      k->w += nbytes(starts);
+      k->l += nbytes(eqbytes(x, '\n'));
+      inspace = sp >> 63;
+    }
+    p = (char*)buf;
+    for(i = nw * 8; i < n; i++){
+      if(p[i] == '\n')
+        k->l++;
+      if(!space[(uchar)p[i]] && inspace)
+        k->w++;
+      inspace = space[(uchar)p[i]];
     }
   }
-  if(n < 0){
+  if(n < 0)
+    k->err = 1;
+}
+
+void
+wc(int fd, char *name)
+{
+  struct count k;
+
+  count(fd, &k);
+  if(k.err){
     printf("wc: read error\n");
     exit(1);
   }
-  printf("%d %d %d %s\n", l, w, c, name);
+  printf("%d %d %d %s\n", k.l, k.w, k.c, name);
+}
+
+// count name in a child process, which sends
+// back its struct count through a pipe.
+int
+start(char *name)
+{
+  int p[2], fd;
+  struct count k;
+
+  if(pipe(p) < 0){
+    printf("wc: pipe failed\n");
+    exit(1);
+  }
+  switch(fork()){
+  case -1:
+    printf("wc: fork failed\n");
+    exit(1);
+  case 0:
+    close(p[0]);
+    if((fd = open(name, O_RDONLY)) < 0){
+      memset(&k, 0, sizeof(k));
+      k.err = 2;
+    } else {
+      count(fd, &k);
+      close(fd);
+    }
+    write(p[1], &k, sizeof(k));
+    exit(0);
+  }
+  close(p[1]);
+  return p[0];
+}
+
+void
+finish(int fd, char *name)
+{
+  struct count k;
+
+  if(read(fd, &k, sizeof(k)) != sizeof(k))
+    k.err = 1;
+  close(fd);
+  wait(0);
+  if(k.err == 2){
+    printf("wc: cannot open %s\n", name);
+    exit(1);
+  }
+  if(k.err){
+    printf("wc: read error\n");
+    exit(1);
+  }
+  printf("%d %d %d %s\n", k.l, k.w, k.c, name);
 }
 
 int
 main(int argc, char *argv[])
 {
-  int fd, i;
+  int fd, i, fds[NPAR];
+  char *ws = " \r\t\n\v";
+
+  for(; *ws; ws++)
+    space[(uchar)*ws] = 1;
 
   if(argc <= 1){
     wc(0, "");
     exit(0);
   }
 
-  for(i = 1; i < argc; i++){
-    if((fd = open(argv[i], O_RDONLY)) < 0){
-      printf("wc: cannot open %s\n", argv[i]);
+  if(argc == 2){
+    if((fd = open(argv[1], O_RDONLY)) < 0){
+      printf("wc: cannot open %s\n", argv[1]);
       exit(1);
     }
-    wc(fd, argv[i]);
+    wc(fd, argv[1]);
     close(fd);
+    exit(0);
+  }
+
+  // several files: count them in parallel, but
+  // print the results in argument order.
+  for(i = 1; i < argc; i++){
+    if(i > NPAR)
+      finish(fds[(i-NPAR) % NPAR], argv[i-NPAR]);
+    fds[i % NPAR] = start(argv[i]);
   }
+  for(i = argc - NPAR; i < argc; i++)
+    if(i >= 1)
+      finish(fds[i % NPAR], argv[i]);
   exit(0);
 }